@@ -0,0 +1,188 @@
+#include "CpuAffinity.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace {
+
+// Cores this far below the fastest one are too slow to share decode steps with it
+constexpr double kDecodeSpeedRatio = 0.8;
+
+bool readFile(const std::string& path, std::string& out) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) return false;
+    char buf[256];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    out.assign(buf, n);
+    return true;
+}
+
+uint64_t readNumber(const std::string& path) {
+    std::string text;
+    if (!readFile(path, text)) return 0;
+    return strtoull(text.c_str(), nullptr, 10);
+}
+
+// Kernel CPU list format: "0-3,6,8-9"
+std::vector<int> parseCpuList(const std::string& text) {
+    std::vector<int> cpus;
+    const char* p = text.c_str();
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p) break;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1) break;
+            p = end;
+        }
+        for (long cpu = first; cpu <= last && cpu < 4096; cpu++) {
+            cpus.push_back((int)cpu);
+        }
+        if (*p != ',') break;
+        p++;
+    }
+    return cpus;
+}
+
+}  // namespace
+
+namespace CpuAffinity {
+
+CpuTopology detect(const std::string& sysfsRoot) {
+    CpuTopology topology;
+
+    std::string list;
+    std::vector<int> ids;
+    if (readFile(sysfsRoot + "/online", list) || readFile(sysfsRoot + "/possible", list)) {
+        ids = parseCpuList(list);
+    }
+    if (ids.empty()) {
+        int count = std::max(1, (int)std::thread::hardware_concurrency());
+        for (int i = 0; i < count; i++) ids.push_back(i);
+    }
+
+    bool allCapacity = true;
+    bool allFreq = true;
+    for (int id : ids) {
+        std::string dir = sysfsRoot + "/cpu" + std::to_string(id);
+        CpuCore core;
+        core.id = id;
+        core.capacity = (int)readNumber(dir + "/cpu_capacity");
+        core.maxFreqKhz = readNumber(dir + "/cpufreq/cpuinfo_max_freq");
+        allCapacity = allCapacity && core.capacity > 0;
+        allFreq = allFreq && core.maxFreqKhz > 0;
+        topology.cores.push_back(core);
+    }
+
+    // Capacity already folds in microarchitecture; frequency is the fallback.
+    // Without either every core looks the same.
+    auto speed = [&](const CpuCore& core) -> uint64_t {
+        if (allCapacity) return (uint64_t)core.capacity;
+        if (allFreq) return core.maxFreqKhz;
+        return 0;
+    };
+    std::stable_sort(topology.cores.begin(), topology.cores.end(),
+                     [&](const CpuCore& a, const CpuCore& b) { return speed(a) > speed(b); });
+
+    int total = (int)topology.cores.size();
+    uint64_t fastest = speed(topology.cores.front());
+    uint64_t slowest = speed(topology.cores.back());
+    topology.heterogeneous = fastest != slowest;
+
+    if (!topology.heterogeneous) {
+        // No cluster information (or a uniform CPU, possibly with SMT siblings)
+        topology.performanceCores = total;
+        topology.decodeThreads = std::max(1, std::min(kMaxDecodeThreads, total / 2));
+        topology.prefillThreads = std::max(topology.decodeThreads, std::min(kMaxPrefillThreads, total));
+        return topology;
+    }
+
+    int performance = 0;
+    int decode = 0;
+    for (const CpuCore& core : topology.cores) {
+        if (speed(core) == slowest) break;
+        performance++;
+        if (speed(core) >= fastest * kDecodeSpeedRatio) decode++;
+    }
+    topology.performanceCores = performance;
+    topology.prefillThreads = std::min(kMaxPrefillThreads, performance);
+    topology.decodeThreads = std::min(kMaxDecodeThreads, decode);
+    return topology;
+}
+
+const CpuTopology& system() {
+    static const CpuTopology topology = detect();
+    return topology;
+}
+
+std::vector<int> fastestCores(const CpuTopology& topology, int n) {
+    std::vector<int> cpus;
+    if (!topology.heterogeneous || n <= 0 || n > topology.performanceCores) return cpus;
+    for (int i = 0; i < n; i++) {
+        cpus.push_back(topology.cores[i].id);
+    }
+    return cpus;
+}
+
+uint64_t fingerprint(const CpuTopology& topology) {
+    uint64_t hash = 1469598103934665603ull;  // FNV-1a
+    auto mix = [&](uint64_t value) {
+        for (int i = 0; i < 8; i++) {
+            hash ^= (value >> (i * 8)) & 0xff;
+            hash *= 1099511628211ull;
+        }
+    };
+    for (const CpuCore& core : topology.cores) {
+        mix((uint64_t)core.id);
+        mix((uint64_t)core.capacity);
+        mix(core.maxFreqKhz);
+    }
+    return hash;
+}
+
+#ifdef __linux__
+
+std::vector<int> currentAffinity() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+bool pinCurrentThread(const std::vector<int>& cpus) {
+    if (cpus.empty()) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    // pid 0 is the calling thread, not the whole process
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+#else
+
+std::vector<int> currentAffinity() {
+    return {};
+}
+
+bool pinCurrentThread(const std::vector<int>&) {
+    return false;
+}
+
+#endif
+
+}  // namespace CpuAffinity
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// One logical CPU as described by sysfs
+struct CpuCore {
+    int id = 0;
+    int capacity = 0;          // cpu_capacity (Arm, 1024 = fastest core), 0 if absent
+    uint64_t maxFreqKhz = 0;   // cpufreq/cpuinfo_max_freq, 0 if absent
+};
+
+// Online CPUs ordered fastest first. On big.LITTLE parts the slowest cluster
+// counts as efficiency cores and is left out of both thread counts.
+struct CpuTopology {
+    std::vector<CpuCore> cores;
+    int performanceCores = 0;  // Leading entries of cores that are not efficiency cores
+    bool heterogeneous = false;
+    int prefillThreads = 1;    // Compute bound: every performance core
+    int decodeThreads = 1;     // Bandwidth bound: only the fastest few, so no slow core gates a step
+};
+
+// Core cluster detection from /sys/devices/system/cpu and thread pinning.
+// Both are no-ops that report a homogeneous CPU off Linux.
+namespace CpuAffinity {
+
+constexpr const char* kSysfsRoot = "/sys/devices/system/cpu";
+constexpr int kMaxDecodeThreads = 4;
+constexpr int kMaxPrefillThreads = 8;
+
+// sysfsRoot may point at a fake tree laid out like /sys/devices/system/cpu
+CpuTopology detect(const std::string& sysfsRoot = kSysfsRoot);
+
+// detect() for this device, read once
+const CpuTopology& system();
+
+// IDs of the n fastest cores; empty when pinning would not help (homogeneous
+// CPU, or more threads than cores)
+std::vector<int> fastestCores(const CpuTopology& topology, int n);
+
+// Stable across boots for the same CPU layout (keys per-device tuning)
+uint64_t fingerprint(const CpuTopology& topology);
+
+// Calling thread's allowed CPUs (empty if unknown)
+std::vector<int> currentAffinity();
+
+// Restricts the calling thread to cpus; threads it creates inherit the mask
+bool pinCurrentThread(const std::vector<int>& cpus);
+
+}  // namespace CpuAffinity
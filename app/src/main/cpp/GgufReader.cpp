@@ -0,0 +1,322 @@
+#include "GgufReader.h"
+#include "Logging.h"
+#include "ggml.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <sys/stat.h>
+
+#define TAG "HaloAI-GGUF"
+#define LOGI(...) Logging::write(Logging::Level::Info, TAG, __VA_ARGS__)
+#define LOGW(...) Logging::write(Logging::Level::Warn, TAG, __VA_ARGS__)
+
+namespace {
+
+enum ValueType : uint32_t {
+    kU8 = 0, kI8 = 1, kU16 = 2, kI16 = 3, kU32 = 4, kI32 = 5, kF32 = 6, kBool = 7,
+    kString = 8, kArray = 9, kU64 = 10, kI64 = 11, kF64 = 12,
+};
+
+constexpr uint32_t kMagic = 0x46554747;  // "GGUF"
+constexpr uint64_t kMaxString = 1u << 24;  // Chat templates are a few KB; anything huge is corrupt
+
+// Sequential reader over a FILE* with sticky failure
+class Reader {
+public:
+    explicit Reader(FILE* file) : _file(file) {}
+    bool ok() const { return _ok; }
+    void fail() { _ok = false; }
+
+    template <typename T>
+    T get() {
+        T value{};
+        if (_ok && fread(&value, sizeof(T), 1, _file) != 1) _ok = false;
+        return value;
+    }
+
+    std::string string() {
+        uint64_t len = get<uint64_t>();
+        std::string value;
+        if (!_ok || len > kMaxString) {
+            _ok = false;
+            return value;
+        }
+        value.resize(len);
+        if (len && fread(&value[0], 1, len, _file) != len) _ok = false;
+        return value;
+    }
+
+    void skip(uint64_t bytes) {
+        if (_ok && fseeko(_file, (off_t)bytes, SEEK_CUR) != 0) _ok = false;
+    }
+
+    // Integer value of any numeric type; false for strings, arrays and floats
+    bool integer(uint32_t type, int64_t& value) {
+        switch (type) {
+            case kU8:  value = get<uint8_t>(); return true;
+            case kI8:  value = get<int8_t>(); return true;
+            case kU16: value = get<uint16_t>(); return true;
+            case kI16: value = get<int16_t>(); return true;
+            case kU32: value = get<uint32_t>(); return true;
+            case kI32: value = get<int32_t>(); return true;
+            case kU64: value = (int64_t)get<uint64_t>(); return true;
+            case kI64: value = get<int64_t>(); return true;
+            default:   return false;
+        }
+    }
+
+    void skipValue(uint32_t type) {
+        if (type == kString) {
+            skip(get<uint64_t>());
+        } else if (type == kArray) {
+            uint32_t elemType = get<uint32_t>();
+            skipArray(elemType, get<uint64_t>());
+        } else if (uint64_t size = scalarSize(type)) {
+            skip(size);
+        } else {
+            fail();
+        }
+    }
+
+    void skipArray(uint32_t elemType, uint64_t count) {
+        if (elemType == kString) {
+            for (uint64_t i = 0; i < count && _ok; ++i) skip(get<uint64_t>());
+        } else if (uint64_t size = scalarSize(elemType)) {
+            skip(size * count);
+        } else {
+            fail();  // Nested arrays do not occur in model files
+        }
+    }
+
+    static uint64_t scalarSize(uint32_t type) {
+        switch (type) {
+            case kU8: case kI8: case kBool:  return 1;
+            case kU16: case kI16:            return 2;
+            case kU32: case kI32: case kF32: return 4;
+            case kU64: case kI64: case kF64: return 8;
+            default:                         return 0;
+        }
+    }
+
+private:
+    FILE* _file;
+    bool _ok = true;
+};
+
+// llama_ftype names as written by the quantizer (general.file_type)
+const char* fileTypeName(int64_t fileType) {
+    switch (fileType) {
+        case 0:  return "F32";
+        case 1:  return "F16";
+        case 2:  return "Q4_0";
+        case 3:  return "Q4_1";
+        case 7:  return "Q8_0";
+        case 8:  return "Q5_0";
+        case 9:  return "Q5_1";
+        case 10: return "Q2_K";
+        case 11: return "Q3_K_S";
+        case 12: return "Q3_K_M";
+        case 13: return "Q3_K_L";
+        case 14: return "Q4_K_S";
+        case 15: return "Q4_K_M";
+        case 16: return "Q5_K_S";
+        case 17: return "Q5_K_M";
+        case 18: return "Q6_K";
+        case 19: return "IQ2_XXS";
+        case 20: return "IQ2_XS";
+        case 21: return "Q2_K_S";
+        case 22: return "IQ3_XS";
+        case 23: return "IQ3_XXS";
+        case 24: return "IQ1_S";
+        case 25: return "IQ4_NL";
+        case 26: return "IQ3_S";
+        case 27: return "IQ3_M";
+        case 28: return "IQ2_S";
+        case 29: return "IQ2_M";
+        case 30: return "IQ4_XS";
+        case 31: return "IQ1_M";
+        case 32: return "BF16";
+        case 36: return "TQ1_0";
+        case 37: return "TQ2_0";
+        default: return nullptr;
+    }
+}
+
+struct CacheEntry {
+    int64_t size;
+    int64_t mtime;
+    ModelMetadata metadata;
+};
+
+std::mutex gCacheMutex;
+std::unordered_map<std::string, CacheEntry> gCache;
+
+}  // namespace
+
+namespace GgufReader {
+
+bool read(const char* path, ModelMetadata& metadata) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        LOGW("Cannot open %s", path);
+        return false;
+    }
+    // The tokenizer section is many small strings; a large buffer keeps it to a few reads
+    setvbuf(file, nullptr, _IOFBF, 1 << 16);
+    Reader in(file);
+
+    uint32_t magic = in.get<uint32_t>();
+    uint32_t version = in.get<uint32_t>();
+    if (!in.ok() || magic != kMagic || version < 2) {
+        LOGW("Not a GGUF v2+ file: %s", path);
+        fclose(file);
+        return false;
+    }
+    uint64_t tensorCount = in.get<uint64_t>();
+    uint64_t kvCount = in.get<uint64_t>();
+
+    // Architecture-scoped keys ("llama.block_count") may precede general.architecture
+    std::map<std::string, int64_t> integers;
+    int64_t fileType = -1;
+    for (uint64_t i = 0; i < kvCount && in.ok(); ++i) {
+        std::string key = in.string();
+        uint32_t type = in.get<uint32_t>();
+        int64_t value;
+
+        if (type == kString && (key == "general.architecture" || key == "general.name" ||
+                                key == "tokenizer.chat_template")) {
+            std::string text = in.string();
+            if (key == "general.architecture") metadata.architecture = text;
+            else if (key == "general.name") metadata.name = text;
+            else metadata.chatTemplate = text;
+        } else if (type == kArray && key == "tokenizer.ggml.tokens") {
+            uint32_t elemType = in.get<uint32_t>();
+            uint64_t count = in.get<uint64_t>();
+            metadata.vocabSize = (int)count;
+            in.skipArray(elemType, count);
+        } else if (in.integer(type, value)) {
+            if (key == "general.file_type") fileType = value;
+            else integers[key] = value;
+        } else {
+            in.skipValue(type);
+        }
+    }
+
+    // Tensor descriptors: name, shape, type and data offset
+    std::map<int, int64_t> bytesByType;
+    for (uint64_t i = 0; i < tensorCount && in.ok(); ++i) {
+        in.skip(in.get<uint64_t>());
+        uint32_t nDims = in.get<uint32_t>();
+        if (nDims > 4) {
+            in.fail();
+            break;
+        }
+        int64_t ne[4] = {1, 1, 1, 1};
+        for (uint32_t d = 0; d < nDims; ++d) ne[d] = (int64_t)in.get<uint64_t>();
+        uint32_t type = in.get<uint32_t>();
+        in.skip(sizeof(uint64_t));
+        if (!in.ok()) break;
+
+        // Bytes as ggml_row_size computes them (whole blocks times the block
+        // size), with overflow checks; it would assert on a partial block. A bad
+        // type or shape fails the parse instead.
+        int64_t blck = type < GGML_TYPE_COUNT ? ggml_blck_size((ggml_type)type) : 0;
+        int64_t rows = 0;
+        int64_t elements = 0;
+        int64_t rowBytes = 0;
+        int64_t bytes = 0;
+        bool valid = blck > 0 && ne[0] % blck == 0 &&
+                     std::all_of(ne, ne + 4, [](int64_t n) { return n >= 0; }) &&
+                     !__builtin_mul_overflow(ne[1], ne[2], &rows) &&
+                     !__builtin_mul_overflow(rows, ne[3], &rows) &&
+                     !__builtin_mul_overflow(ne[0], rows, &elements) &&
+                     !__builtin_mul_overflow(ne[0] / blck, (int64_t)ggml_type_size((ggml_type)type), &rowBytes) &&
+                     !__builtin_mul_overflow(rowBytes, rows, &bytes);
+        if (!valid) {
+            in.fail();
+            break;
+        }
+        if (__builtin_add_overflow(metadata.parameterCount, elements, &metadata.parameterCount) ||
+            __builtin_add_overflow(bytesByType[(int)type], bytes, &bytesByType[(int)type])) {
+            in.fail();
+            break;
+        }
+    }
+    fclose(file);
+
+    if (!in.ok()) {
+        LOGW("Truncated or corrupt GGUF header: %s", path);
+        return false;
+    }
+
+    const std::string& arch = metadata.architecture;
+    auto archInt = [&](const char* suffix) -> int64_t {
+        auto it = integers.find(arch + "." + suffix);
+        return it != integers.end() ? it->second : 0;
+    };
+    int64_t contextLength = archInt("context_length");
+    metadata.contextSize = contextLength > 0 ? (int)contextLength : 4096;
+    metadata.layerCount = (int)archInt("block_count");
+    metadata.embeddingLength = (int)archInt("embedding_length");
+    metadata.feedForwardLength = (int)archInt("feed_forward_length");
+    metadata.headCount = (int)archInt("attention.head_count");
+    metadata.headCountKv = (int)archInt("attention.head_count_kv");
+    if (metadata.headCountKv == 0) metadata.headCountKv = metadata.headCount;
+    // Some models (e.g. Gemma) use heads wider than embedding_length / head_count
+    int headDim = metadata.headCount > 0 ? metadata.embeddingLength / metadata.headCount : 0;
+    metadata.keyLength = (int)archInt("attention.key_length");
+    metadata.valueLength = (int)archInt("attention.value_length");
+    if (metadata.keyLength <= 0) metadata.keyLength = headDim;
+    if (metadata.valueLength <= 0) metadata.valueLength = headDim;
+
+    for (const auto& entry : bytesByType) {
+        metadata.tensorBytes += entry.second;
+        metadata.bytesByType.emplace_back(ggml_type_name((ggml_type)entry.first), entry.second);
+    }
+    std::sort(metadata.bytesByType.begin(), metadata.bytesByType.end(),
+              [](const auto& a, const auto& b) { return a.second > b.second; });
+
+    const char* fileTypeText = fileTypeName(fileType);
+    if (fileTypeText) {
+        metadata.quantization = fileTypeText;
+    } else if (!metadata.bytesByType.empty()) {
+        metadata.quantization = metadata.bytesByType.front().first;
+    }
+
+    metadata.valid = true;
+    LOGI("%s: %s %s, %lld params, %d layers, ctx %d, vocab %d, template %zu chars",
+         path, arch.c_str(), metadata.quantization.c_str(), (long long)metadata.parameterCount,
+         metadata.layerCount, metadata.contextSize, metadata.vocabSize, metadata.chatTemplate.size());
+    return true;
+}
+
+ModelMetadata readCached(const char* path) {
+    struct stat st {};
+    if (stat(path, &st) != 0) {
+        LOGW("Cannot stat %s", path);
+        return ModelMetadata();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(gCacheMutex);
+        auto it = gCache.find(path);
+        if (it != gCache.end() && it->second.size == (int64_t)st.st_size &&
+            it->second.mtime == (int64_t)st.st_mtime) {
+            return it->second.metadata;
+        }
+    }
+
+    ModelMetadata metadata;
+    if (!read(path, metadata)) {
+        return ModelMetadata();
+    }
+
+    std::lock_guard<std::mutex> lock(gCacheMutex);
+    gCache[path] = {(int64_t)st.st_size, (int64_t)st.st_mtime, metadata};
+    return metadata;
+}
+
+}  // namespace GgufReader
@@ -0,0 +1,38 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Model metadata structure
+struct ModelMetadata {
+    int contextSize = 4096;
+    std::string chatTemplate = "";
+    std::string architecture = "";
+    bool valid = false;
+
+    std::string name;               // general.name
+    std::string quantization;       // File type (e.g. "Q4_K_M"), or the dominant tensor type
+    int64_t parameterCount = 0;     // Elements across all tensors
+    int layerCount = 0;
+    int vocabSize = 0;
+    int embeddingLength = 0;
+    int feedForwardLength = 0;
+    int headCount = 0;
+    int headCountKv = 0;            // Fewer than headCount with grouped-query attention
+    int keyLength = 0;              // Per head; attention.key_length, else embeddingLength / headCount
+    int valueLength = 0;            // Per head; attention.value_length, else embeddingLength / headCount
+    int64_t tensorBytes = 0;        // Weight data, excluding the header
+    std::vector<std::pair<std::string, int64_t>> bytesByType;  // Weight bytes per ggml type, largest first
+};
+
+// Reads GGUF headers (key/values and tensor descriptors) with buffered I/O;
+// the weights are never mapped or read
+namespace GgufReader {
+
+bool read(const char* path, ModelMetadata& metadata);
+
+// read() behind a process-wide cache keyed by path, size and mtime
+ModelMetadata readCached(const char* path);
+
+}  // namespace GgufReader
@@ -1,161 +1,433 @@
 #include "LLMInference.h"
-#include <android/log.h>
+#include "SessionStore.h"
+#include "MemoryPlanner.h"
+#include "CpuAffinity.h"
+#include "Logging.h"
+#include <ggml-cpu.h>
 #include <cstring>
 #include <chrono>
 #include <sstream>
 #include <algorithm>
-#include <gguf.h>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
 
 #define TAG "HaloAI-LLMInference"
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
-#define LOGW(...) __android_log_print(ANDROID_LOG_WARN, TAG, __VA_ARGS__)
+#define LOGI(...) Logging::write(Logging::Level::Info, TAG, __VA_ARGS__)
+#define LOGE(...) Logging::write(Logging::Level::Error, TAG, __VA_ARGS__)
+#define LOGW(...) Logging::write(Logging::Level::Warn, TAG, __VA_ARGS__)
 
 static bool backend_initialized = false;
 
-// Static method to read model metadata using GGUF library (more efficient)
+// Header-only read; never maps the weights
 ModelMetadata LLMInference::getModelMetadata(const char* modelPath) {
-    ModelMetadata metadata;
+    return GgufReader::readCached(modelPath);
+}
 
-    LOGI("Reading metadata from GGUF: %s", modelPath);
+// Drop everything in the KV cache and forget which tokens it held
+void LLMInference::_clearCache() {
+    if (_ctx) {
+        _releaseForks(0);
+        llama_memory_t mem = llama_get_memory(_ctx);
+        // Only sequence 0: batched sessions keep their own cells
+        if (mem) {
+            llama_memory_seq_rm(mem, 0, -1, -1);
+        }
+    }
+    _cacheTokens.clear();
+    _nCtxUsed = 0;
+    _prevRendered.clear();
+}
 
-    // Use GGUF library directly like SmolLM implementation
-    gguf_init_params initParams = { .no_alloc = true, .ctx = nullptr };
-    gguf_context* ggufContext = gguf_init_from_file(modelPath, initParams);
+// addBos only at the start of a conversation; parseSpecial for rendered
+// chat-template text, whose role markers are special tokens
+std::vector<llama_token> LLMInference::_tokenize(const std::string& text, bool addBos, bool parseSpecial) const {
+    const llama_vocab* vocab = llama_model_get_vocab(_model);
+    std::vector<llama_token> tokens(text.length() + 256);
 
-    if (!ggufContext) {
-        LOGW("Failed to read GGUF metadata, falling back to llama method");
-        return getModelMetadataFallback(modelPath);
+    int n_tokens = llama_tokenize(vocab, text.c_str(), text.length(),
+                                  tokens.data(), tokens.size(), addBos, parseSpecial);
+    if (n_tokens < 0) {
+        tokens.resize(-n_tokens);
+        n_tokens = llama_tokenize(vocab, text.c_str(), text.length(),
+                                  tokens.data(), tokens.size(), addBos, parseSpecial);
+    }
+    if (n_tokens < 0) {
+        return {};
     }
 
-    // Get context size
-    metadata.contextSize = 4096; // default fallback
-    int64_t architectureKeyId = gguf_find_key(ggufContext, "general.architecture");
+    tokens.resize(n_tokens);
+    return tokens;
+}
 
-    if (architectureKeyId != -1) {
-        std::string architecture = gguf_get_val_str(ggufContext, architectureKeyId);
-        std::string contextLengthKey = architecture + ".context_length";
-        int64_t contextLengthKeyId = gguf_find_key(ggufContext, contextLengthKey.c_str());
+// Text every new conversation starts with, ending on a token boundary
+std::string LLMInference::_systemPrefixText() const {
+    if (_chatTemplate == nullptr) {
+        return _systemPrompt + " User says:";
+    }
+    if (_systemPrompt.empty()) {
+        return "";
+    }
 
-        if (contextLengthKeyId != -1) {
-            uint32_t contextLength = gguf_get_val_u32(ggufContext, contextLengthKeyId);
-            metadata.contextSize = static_cast<int>(contextLength);
-            LOGI("Context size from GGUF: %d", static_cast<int>(contextLength));
-        }
+    llama_chat_message system = {"system", _systemPrompt.c_str()};
+    std::vector<char> buf(_systemPrompt.length() + 256);
+    int len = llama_chat_apply_template(_chatTemplate, &system, 1, false, buf.data(), buf.size());
+    if (len > (int)buf.size()) {
+        buf.resize(len);
+        len = llama_chat_apply_template(_chatTemplate, &system, 1, false, buf.data(), buf.size());
     }
+    return len > 0 ? std::string(buf.data(), len) : "";
+}
 
-    // Get chat template
-    int64_t chatTemplateKeyId = gguf_find_key(ggufContext, "tokenizer.chat_template");
-    if (chatTemplateKeyId != -1) {
-        metadata.chatTemplate = gguf_get_val_str(ggufContext, chatTemplateKeyId);
-        LOGI("Chat template from GGUF: %zu chars", metadata.chatTemplate.length());
-    } else {
-        LOGW("No chat template in GGUF");
+// Decode the system prefix once into sequence 0 and keep a host copy of its KV
+bool LLMInference::_primePrefixCache(const std::string& text) {
+    _prefixText = text;
+    _prefixTokens = _tokenize(text, _chatTemplate != nullptr, _chatTemplate != nullptr);
+    _prefixState.clear();
+    _clearCache();
+
+    if (_prefixTokens.empty()) {
+        return false;
     }
 
-    // Try to get architecture
-    if (architectureKeyId != -1) {
-        metadata.architecture = gguf_get_val_str(ggufContext, architectureKeyId);
-        LOGI("Architecture from GGUF: %s", metadata.architecture.c_str());
+    if (!_decodeChunked(_prefixTokens.data(), (int)_prefixTokens.size(), nullptr)) {
+        LOGE("Failed to decode system prefix");
+        _prefixTokens.clear();
+        _clearCache();
+        return false;
     }
 
-    metadata.valid = true;
+    _prefixState.resize(llama_state_seq_get_size(_ctx, 0));
+    if (llama_state_seq_get_data(_ctx, _prefixState.data(), _prefixState.size(), 0) != _prefixState.size()) {
+        _prefixState.clear();
+    }
 
-    // Note: We don't free ggufContext as per GGUF library usage
-    return metadata;
+    LOGI("System prefix cached: %zu tokens, %zu bytes", _prefixTokens.size(), _prefixState.size());
+    return true;
 }
 
-// Fallback metadata reading using llama (keeps compatibility)
-ModelMetadata LLMInference::getModelMetadataFallback(const char* modelPath) {
-    ModelMetadata metadata;
+void LLMInference::_applyPrefixCache() {
+    if (!isReady()) return;
 
-    LOGI("Fallback: Reading metadata with llama: %s", modelPath);
+    std::string text = _systemPrefixText();
+    if (text.empty()) {
+        _clearCache();
+        return;
+    }
+    if (text != _prefixText || _prefixState.empty()) {
+        _primePrefixCache(text);
+        return;
+    }
 
-    // Initialize GGML context with no_alloc = true (doesn't load weights)
-    ggml_init_params params = {
-        .mem_size = 1024 * 1024,  // 1MB for metadata only
-        .mem_buffer = nullptr,
-        .no_alloc = true
-    };
+    llama_memory_t mem = llama_get_memory(_ctx);
+    bool resident = _cacheTokens.size() >= _prefixTokens.size() &&
+                    std::equal(_prefixTokens.begin(), _prefixTokens.end(), _cacheTokens.begin());
+
+    // Prefix still in the KV cache: just drop the old conversation after it
+    if (resident && llama_memory_seq_rm(mem, 0, (llama_pos)_prefixTokens.size(), -1)) {
+        _cacheTokens.resize(_prefixTokens.size());
+        _nCtxUsed = (int)_cacheTokens.size();
+        return;
+    }
+
+    // Otherwise copy the snapshot back into sequence 0
+    _clearCache();
+    if (llama_state_seq_set_data(_ctx, _prefixState.data(), _prefixState.size(), 0) == 0) {
+        LOGW("Failed to restore system prefix, re-priming");
+        _primePrefixCache(text);
+        return;
+    }
+    _cacheTokens = _prefixTokens;
+    _nCtxUsed = (int)_cacheTokens.size();
+    LOGI("System prefix restored from cache (%zu tokens)", _prefixTokens.size());
+}
 
-    struct ggml_context* meta_ctx = ggml_init(params);
-    if (!meta_ctx) {
-        LOGE("Failed to create metadata context");
-        return metadata;
+// Decode tokens in chunks of _prefillChunk, appending each chunk to _cacheTokens.
+// Stops between chunks if onProgress returns false or a cancel was requested;
+// the KV cache then holds exactly the chunks that completed, so a retry reuses them.
+bool LLMInference::_decodeChunked(const llama_token* tokens, int count, const PrefillCallback& onProgress) {
+    _prefillCancelled = false;
+    _mainLogitsIdx = -1;
+    int chunk = std::max(1, std::min(_prefillChunk, (int)llama_n_batch(_ctx)));
+
+    for (int done = 0; done < count; ) {
+        if (_cancelRequested.load()) {
+            _prefillCancelled = true;
+            break;
+        }
+
+        int n = std::min(chunk, count - done);
+        llama_batch batch = llama_batch_get_one(const_cast<llama_token*>(tokens + done), n);
+        float elapsedMs = 0;
+        int rc = _decode(batch, elapsedMs);
+        if (rc == 2 && _cancelRequested.load()) {
+            // Aborted mid-chunk: drop whatever part of it reached the cache
+            _trimCacheToTokens();
+            _prefillCancelled = true;
+            break;
+        }
+        if (rc != 0) {
+            _clearCache();
+            return false;
+        }
+        _cacheTokens.insert(_cacheTokens.end(), tokens + done, tokens + done + n);
+        _nCtxUsed = (int)_cacheTokens.size();
+        _perf.prefillTokens += n;
+        _perf.prefillMs += elapsedMs;
+        done += n;
+
+        if (onProgress && !onProgress(done, count) && done < count) {
+            _prefillCancelled = true;
+            break;
+        }
     }
 
-    // Load model metadata
-    llama_model* model = llama_model_load_from_file(modelPath, llama_model_default_params());
-    if (!model) {
-        LOGE("Failed to load model metadata");
-        ggml_free(meta_ctx);
-        return metadata;
+    if (_prefillCancelled) {
+        LOGI("Prefill cancelled at %zu tokens", _cacheTokens.size());
+        return false;
     }
+    return true;
+}
 
-    // Get context size from model
-    metadata.contextSize = llama_model_n_ctx_train(model);
-    if (metadata.contextSize <= 0) {
-        metadata.contextSize = 4096; // fallback
+// Decode the sampled token so its logits are ready for the next step.
+// An abort from requestCancel() is not an error: the cache is simply left without it.
+bool LLMInference::_decodeToken(llama_token token) {
+    if (!_sessions.empty()) {
+        _reapSessions();
+        if (_hasRunnableSessions()) {
+            return _decodeTokenWithSessions(token);
+        }
     }
-    LOGI("Model context size: %d", metadata.contextSize);
 
-    // Get chat template
-    const char* template_str = llama_model_chat_template(model, nullptr);
-    if (template_str) {
-        metadata.chatTemplate = template_str;
-        LOGI("Chat template found: %zu chars", metadata.chatTemplate.length());
-    } else {
-        LOGW("No chat template in model");
+    _mainLogitsIdx = -1;
+    llama_batch batch = llama_batch_get_one(&token, 1);
+    float elapsedMs = 0;
+    int rc = _decode(batch, elapsedMs);
+    if (rc == 2 && _cancelRequested.load()) {
+        _trimCacheToTokens();
+        return true;
     }
+    if (rc != 0) {
+        _clearCache();
+        return false;
+    }
+    _perf.decodeTokens++;
+    _perf.decodeMs += elapsedMs;
+    _decodeLatenciesMs.push_back(elapsedMs);
+    _cacheTokens.push_back(token);
+    _nCtxUsed = (int)_cacheTokens.size();
+    if (_autoTune) {
+        _tuneThreads(elapsedMs);
+    }
+    return true;
+}
 
-    // Get architecture name
-    char arch_buf[128];
-    int arch_len = llama_model_desc(model, arch_buf, sizeof(arch_buf));
-    if (arch_len > 0) {
-        metadata.architecture = std::string(arch_buf, arch_len);
-        LOGI("Architecture: %s", metadata.architecture.c_str());
+// Feed a plain single-token step to the tuner and apply its choice. Batched
+// steps (sessions, speculation) run on the prefill threads and are not measured.
+void LLMInference::_tuneThreads(float decodeMs) {
+    int before = _threadTuner.threads();
+    int threads = _threadTuner.record(decodeMs);
+    if (threads != before) {
+        llama_set_n_threads(_ctx, threads, _batchThreads);
+    }
+    if (_threadTuner.takeSettled()) {
+        LOGI("Thread tuner settled on %d decode threads", threads);
+        if (!_tuneStatePath.empty() && !ThreadTuner::save(_tuneStatePath, _tuneKey, threads)) {
+            LOGW("Failed to save thread tuning to %s", _tuneStatePath.c_str());
+        }
     }
+}
 
-    metadata.valid = true;
+// llama_decode on the main context, timed. The first successful call after
+// load is also recorded as page-in time, since it faults the mmap'd weights in.
+// The calling thread computes its share of the graph too, so it is pinned to
+// the same cores as the pool llama.cpp picks for the batch, then restored.
+int LLMInference::_decode(llama_batch batch, float& elapsedMs) {
+    const std::vector<int>& cores = batch.n_tokens > 1 || _autoTune ? _batchCores : _decodeCores;
+    std::vector<int> saved = cores.empty() ? std::vector<int>() : CpuAffinity::currentAffinity();
+    bool pinned = !saved.empty() && CpuAffinity::pinCurrentThread(cores);
 
-    // Cleanup
-    llama_model_free(model);
-    ggml_free(meta_ctx);
+    auto start = std::chrono::steady_clock::now();
+    int rc = llama_decode(_ctx, batch);
+    elapsedMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (pinned) {
+        CpuAffinity::pinCurrentThread(saved);
+    }
+    if (rc == 0 && !_pagedIn) {
+        _pagedIn = true;
+        _perf.pageInMs = elapsedMs;
+    }
+    return rc;
+}
 
-    return metadata;
+// Sample from the logits at idx and feed the choice back to the sampler chain
+llama_token LLMInference::_sample(int idx) {
+    auto start = std::chrono::steady_clock::now();
+    // llama_sampler_sample already accepts the token into the chain
+    llama_token token = _grammar ? Sampling::sampleConstrained(_sampler, _grammar, _ctx, idx, _candidates)
+                                 : llama_sampler_sample(_sampler, _ctx, idx);
+    _perf.sampleMs += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return token;
 }
 
-bool LLMInference::_isValidUtf8(const char* str) {
-    if (!str) return true;
-    const unsigned char* bytes = (const unsigned char*)str;
-    while (*bytes != 0x00) {
-        int num;
-        if ((*bytes & 0x80) == 0x00) {
-            num = 1;
-        } else if ((*bytes & 0xE0) == 0xC0) {
-            num = 2;
-        } else if ((*bytes & 0xF0) == 0xE0) {
-            num = 3;
-        } else if ((*bytes & 0xF8) == 0xF0) {
-            num = 4;
-        } else {
-            return false;
-        }
-        bytes += 1;
-        for (int i = 1; i < num; ++i) {
-            if ((*bytes & 0xC0) != 0x80) {
-                return false;
-            }
-            bytes += 1;
-        }
+// Make the KV cache match _cacheTokens again after an interrupted decode
+void LLMInference::_trimCacheToTokens() {
+    _releaseForks((int)_cacheTokens.size());
+    llama_memory_t mem = llama_get_memory(_ctx);
+    if (!llama_memory_seq_rm(mem, 0, (llama_pos)_cacheTokens.size(), -1)) {
+        _clearCache();
+    }
+}
+
+// Polled by ggml between graph nodes; returning true aborts llama_decode
+bool LLMInference::_abortCallback(void* data) {
+    auto* self = static_cast<LLMInference*>(data);
+    return self->_cancelRequested.load(std::memory_order_relaxed) &&
+           !self->_backgroundStep.load(std::memory_order_relaxed);
+}
+
+// Kept head and discard block for both _shiftContext and _truncatePrompt.
+// Sized from the room sequence 0 has next to batched sessions, so a truncated
+// prompt drops the same blocks a shifted cache would and the prefix still matches.
+void LLMInference::_shiftWindow(int& nKeep, int& nBlock) const {
+    int window = (int)llama_n_ctx(_ctx) - _sessionCells();
+    int keep = _shiftKeep >= 0 ? _shiftKeep : (int)_prefixTokens.size();
+    nKeep = std::max(0, std::min(keep, window / 2));
+    nBlock = _shiftDiscard > 0 ? _shiftDiscard : std::max(1, (window - nKeep) / 2);
+}
+
+// Discard a block of the oldest tokens after the kept head and slide the rest
+// of sequence 0 down, so generation continues without re-prefilling
+bool LLMInference::_shiftContext() {
+    llama_memory_t mem = llama_get_memory(_ctx);
+    if (!llama_memory_can_shift(mem)) {
+        LOGW("Context shift not supported by this model's memory");
+        return false;
     }
+
+    int nPast = (int)_cacheTokens.size();
+    int nKeep = 0;
+    int nBlock = 0;
+    _shiftWindow(nKeep, nBlock);
+    int nDiscard = std::min(nBlock, nPast - nKeep - 1);
+    if (nDiscard <= 0) {
+        return false;
+    }
+
+    _releaseForks(nKeep);
+    if (!llama_memory_seq_rm(mem, 0, nKeep, nKeep + nDiscard)) {
+        return false;
+    }
+    llama_memory_seq_add(mem, 0, nKeep + nDiscard, nPast, -nDiscard);
+
+    _cacheTokens.erase(_cacheTokens.begin() + nKeep, _cacheTokens.begin() + nKeep + nDiscard);
+    _nCtxUsed = (int)_cacheTokens.size();
+
+    LOGI("Context shifted: kept %d, discarded %d, %d remain", nKeep, nDiscard, _nCtxUsed);
     return true;
 }
 
+// Drop whole blocks of the oldest prompt tokens after the kept head until the
+// prompt fits in limit
+void LLMInference::_truncatePrompt(int limit) {
+    int size = (int)_promptTokens.size();
+    int nKeep = 0;
+    int nBlock = 0;
+    _shiftWindow(nKeep, nBlock);
+    int excess = size - limit;
+    int nDiscard = std::min(((excess + nBlock - 1) / nBlock) * nBlock, size - nKeep - 1);
+    if (nDiscard <= 0) {
+        return;
+    }
+
+    _promptTokens.erase(_promptTokens.begin() + nKeep, _promptTokens.begin() + nKeep + nDiscard);
+    LOGW("Prompt truncated: kept %d, discarded %d, %zu remain", nKeep, nDiscard, _promptTokens.size());
+}
+
+void LLMInference::setContextShift(bool enabled, int keepTokens, int discardTokens) {
+    _contextShift = enabled;
+    _shiftKeep = keepTokens;
+    _shiftDiscard = std::max(0, discardTokens);
+}
+
+// Decode borrows the prefill pool while tuning: it spans every performance
+// core, and llama_set_n_threads can then pick any count up to its size
+void LLMInference::setThreadAutoTune(bool enabled, const char* statePath) {
+    if (!isReady()) return;
+    std::lock_guard<std::mutex> lock(_ctxMutex);
+    _autoTune = enabled;
+    _tuneStatePath = statePath ? statePath : "";
+    if (!enabled) {
+        if (_threadpool) {
+            llama_attach_threadpool(_ctx, _threadpool, _threadpoolBatch);
+        }
+        llama_set_n_threads(_ctx, _threads, _batchThreads);
+        return;
+    }
+
+    _tuneKey = _modelFingerprint ^ (CpuAffinity::fingerprint(CpuAffinity::system()) * 0x9E3779B97F4A7C15ull);
+    int saved = _tuneStatePath.empty() ? 0 : ThreadTuner::loadSaved(_tuneStatePath, _tuneKey);
+    int minThreads = std::max(1, std::min(_threads, _batchThreads) / 2);
+    _threadTuner.reset(minThreads, _batchThreads, saved > 0 ? saved : _threads, saved <= 0);
+
+    ggml_threadpool* pool = _threadpoolBatch ? _threadpoolBatch : _threadpool;
+    if (pool) {
+        llama_attach_threadpool(_ctx, pool, pool);
+    }
+    llama_set_n_threads(_ctx, _threadTuner.threads(), _batchThreads);
+    LOGI("Thread auto-tune on: %d-%d threads, starting at %d%s", minThreads, _batchThreads,
+         _threadTuner.threads(), saved > 0 ? " (saved)" : ", probing");
+}
+
+// A loaded context can't take chunks above the n_batch it was created with
+void LLMInference::setPrefillChunkSize(int tokens) {
+    _prefillChunk = std::max(1, tokens);
+    if (_ctx && _prefillChunk > (int)llama_n_batch(_ctx)) {
+        LOGW("Prefill chunk %d exceeds the context's batch size, using %u", _prefillChunk, llama_n_batch(_ctx));
+        _prefillChunk = (int)llama_n_batch(_ctx);
+    }
+}
+
+static ggml_type toGgmlType(KvCacheType type) {
+    switch (type) {
+        case KvCacheType::Q8_0: return GGML_TYPE_Q8_0;
+        case KvCacheType::Q4_0: return GGML_TYPE_Q4_0;
+        default:                return GGML_TYPE_F16;
+    }
+}
+
 bool LLMInference::loadModel(const char* modelPath, int threads, int contextLength,
-                              float temperature, bool storeChats) {
-    LOGI("Loading model: %s (threads=%d, ctx=%d, temp=%.2f)", 
-         modelPath, threads, contextLength, temperature);
+                              float temperature, bool storeChats,
+                              KvCacheType kvCacheType, bool flashAttention) {
+    // Auto threads: prefill is compute bound and uses every performance core,
+    // decode is bandwidth bound and only the fastest ones
+    int batchThreads = threads;
+    if (threads <= 0) {
+        const CpuTopology& cpu = CpuAffinity::system();
+        threads = cpu.decodeThreads;
+        batchThreads = cpu.prefillThreads;
+    }
+
+    // Other settings left to "auto" come from a memory plan for this model and device
+    if (contextLength <= 0 || kvCacheType == KvCacheType::Auto) {
+        MemoryPlan plan = MemoryPlanner::plan(getModelMetadata(modelPath), 0, contextLength,
+                                              kvCacheType, flashAttention, _prefillChunk);
+        if (contextLength <= 0) {
+            contextLength = plan.contextLength;
+        }
+        if (kvCacheType == KvCacheType::Auto) {
+            kvCacheType = plan.kvCacheType;
+        }
+        Logging::write(plan.fits ? Logging::Level::Info : Logging::Level::Warn, TAG,
+                       "Memory plan: ctx %d, kv %s, %.0f MB of %.0f MB budget%s",
+                       plan.contextLength, ggml_type_name(toGgmlType(plan.kvCacheType)),
+                       plan.totalBytes / (1024.0 * 1024.0), plan.budgetBytes / (1024.0 * 1024.0),
+                       plan.fits ? "" : " (does not fit)");
+    }
+
+    LOGI("Loading model: %s (threads=%d/%d, ctx=%d, temp=%.2f, kv=%s, flash_attn=%d)", 
+         modelPath, threads, batchThreads, contextLength, temperature,
+         ggml_type_name(toGgmlType(kvCacheType)), flashAttention);
     
     // Initialize backend once
     if (!backend_initialized) {
@@ -167,148 +439,362 @@ bool LLMInference::loadModel(const char* modelPath, int threads, int contextLeng
     
     // Store settings
     _threads = threads;
+    _batchThreads = batchThreads;
     _contextLength = contextLength;
-    _temperature = temperature;
+    _samplerParams = SamplerParams();
+    _samplerParams.temperature = temperature;
     _storeChats = storeChats;
     
-    // Load model
+    // Load model. Warm-up reads the file ahead of llama.cpp's own page faults.
+    uint64_t weightBytes = _warmup.enabled && _warmup.mlockMaxBytes > 0
+                           ? (uint64_t)getModelMetadata(modelPath).tensorBytes : 0;
+    if (_warmup.enabled && _warmup.prefetch) {
+        _prefetcher.start(modelPath);
+    }
     llama_model_params model_params = llama_model_default_params();
     model_params.use_mmap = true;
-    model_params.use_mlock = false;
+    model_params.use_mlock = weightBytes > 0 && weightBytes <= _warmup.mlockMaxBytes;
+    if (model_params.use_mlock) {
+        LOGI("Locking %.0f MB of weights in memory", weightBytes / (1024.0 * 1024.0));
+    }
+    auto loadStart = std::chrono::steady_clock::now();
     _model = llama_model_load_from_file(modelPath, model_params);
     if (!_model) {
         LOGE("Failed to load model from %s", modelPath);
+        _prefetcher.stop();
         return false;
     }
-    LOGI("Model loaded");
+    _perf = PerfMetrics();
+    _perf.loadMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+    _pagedIn = false;
+    LOGI("Model loaded in %.0f ms", _perf.loadMs);
+    _modelPath = modelPath;
+    _modelFingerprint = SessionStore::fingerprintModel(modelPath);
     
     // Create context
     llama_context_params ctx_params = llama_context_default_params();
     ctx_params.n_ctx = contextLength;
-    ctx_params.n_batch = contextLength;
+    // Bound the compute graph by the prefill chunk rather than the whole context
+    ctx_params.n_batch = std::min(contextLength, _prefillChunk);
+    ctx_params.n_ubatch = ctx_params.n_batch;
     ctx_params.n_threads = threads;
-    ctx_params.n_threads_batch = threads;
+    ctx_params.n_threads_batch = batchThreads;
     ctx_params.no_perf = false;
+    // One KV pool shared by the chat and any batched sessions
+    ctx_params.n_seq_max = kMaxSequences;
+    ctx_params.kv_unified = true;
+    
+    // Quantized V cache needs flash attention; without it only K is quantized
+    _flashAttention = flashAttention;
+    _kvTypeK = toGgmlType(kvCacheType);
+    _kvTypeV = flashAttention ? _kvTypeK : GGML_TYPE_F16;
+    ctx_params.type_k = _kvTypeK;
+    ctx_params.type_v = _kvTypeV;
+    ctx_params.flash_attn_type = flashAttention ? LLAMA_FLASH_ATTN_TYPE_ENABLED : LLAMA_FLASH_ATTN_TYPE_DISABLED;
     
     _ctx = llama_init_from_model(_model, ctx_params);
+    if (!_ctx && flashAttention) {
+        LOGW("Context creation with flash attention failed, retrying without it");
+        _flashAttention = false;
+        _kvTypeV = GGML_TYPE_F16;
+        ctx_params.type_v = _kvTypeV;
+        ctx_params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_DISABLED;
+        _ctx = llama_init_from_model(_model, ctx_params);
+    }
     if (!_ctx) {
         LOGE("Failed to create context");
+        _prefetcher.stop();
+        _freeThreadpools();
         llama_model_free(_model);
         _model = nullptr;
         return false;
     }
-    LOGI("Context created");
+    LOGI("Context created (KV %s/%s, %.1f MB; weights %.1f MB)",
+         ggml_type_name(_kvTypeK), ggml_type_name(_kvTypeV),
+         getKvCacheBytes() / (1024.0 * 1024.0), getModelSizeBytes() / (1024.0 * 1024.0));
+    llama_set_abort_callback(_ctx, _abortCallback, this);
+    _createThreadpools();
+    if (_threadpool) {
+        llama_attach_threadpool(_ctx, _threadpool, _threadpoolBatch);
+    }
+    _sessionBatch = llama_batch_init((int32_t)llama_n_batch(_ctx), 0, 1);
+    if (_warmup.enabled) {
+        _warmupDecode();
+    }
     
     // Create sampler
-    llama_sampler_chain_params sampler_params = llama_sampler_chain_default_params();
-    sampler_params.no_perf = true;
-    _sampler = llama_sampler_chain_init(sampler_params);
-    llama_sampler_chain_add(_sampler, llama_sampler_init_top_k(40));
-    llama_sampler_chain_add(_sampler, llama_sampler_init_top_p(0.95f, 1));
-    llama_sampler_chain_add(_sampler, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(_sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    _sampler = Sampling::createChain(_samplerParams);
     LOGI("Sampler configured");
     
-    // Completely bypass chat templates - they're causing issues
-    // Use raw text approach to get natural responses
-    LOGI("Using raw text approach - completely bypassing chat templates");
-    _chatTemplate = nullptr; // Explicitly null to avoid template processing
+    // Use the chat template embedded in the GGUF. llama.cpp only renders the
+    // templates it recognises, so probe it once and fall back to raw prompts.
+    _modelChatTemplate = llama_model_chat_template(_model, nullptr);
+    _chatTemplate = nullptr;
+    if (_modelChatTemplate) {
+        llama_chat_message probe = {"user", "hi"};
+        char buf[256];
+        if (llama_chat_apply_template(_modelChatTemplate, &probe, 1, true, buf, sizeof(buf)) >= 0) {
+            _chatTemplate = _modelChatTemplate;
+        }
+    }
+    LOGI(_chatTemplate ? "Using the model's chat template" : "No usable chat template, using raw prompts");
     
     // Initialize message storage
     _formattedMessages.resize(contextLength);
-    _messages.clear();
-    _prevLen = 0;
+    _clearMessages();
     
     LOGI("Model initialization complete");
     return true;
 }
 
+// One throwaway token through the model builds the decode graph, starts the
+// threadpools and faults in every weight the real first token will need.
+// Its KV cell is dropped again.
+void LLMInference::_warmupDecode() {
+    llama_token token = llama_vocab_bos(llama_model_get_vocab(_model));
+    if (token == LLAMA_TOKEN_NULL) {
+        token = 0;
+    }
+    // llama_decode directly: the first real decode still reports pageInMs
+    auto start = std::chrono::steady_clock::now();
+    if (llama_decode(_ctx, llama_batch_get_one(&token, 1)) != 0) {
+        LOGW("Warm-up decode failed");
+    }
+    float elapsedMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    _clearCache();
+    _perf.warmupMs = elapsedMs;
+    LOGI("Warm-up decode took %.0f ms", elapsedMs);
+}
+
 void LLMInference::addChatMessage(const char* message, const char* role) {
+    std::lock_guard<std::mutex> lock(_ctxMutex);
+    _addMessage(message, role);
+}
+
+// Caller holds _ctxMutex
+void LLMInference::_addMessage(const char* message, const char* role) {
     _messages.push_back({strdup(role), strdup(message)});
 }
 
+// Renders _messages with the chat template into _formattedMessages; returns
+// the rendered length or a negative error
+int LLMInference::_formatMessages(bool addAssistant) {
+    int len = llama_chat_apply_template(_chatTemplate, _messages.data(), _messages.size(), addAssistant,
+                                        _formattedMessages.data(), _formattedMessages.size());
+    if (len > (int)_formattedMessages.size()) {
+        _formattedMessages.resize(len);
+        len = llama_chat_apply_template(_chatTemplate, _messages.data(), _messages.size(), addAssistant,
+                                        _formattedMessages.data(), _formattedMessages.size());
+    }
+    return len;
+}
+
+void LLMInference::_popMessage() {
+    if (_messages.empty()) return;
+    free(const_cast<char*>(_messages.back().role));
+    free(const_cast<char*>(_messages.back().content));
+    _messages.pop_back();
+}
+
+// After a response: keep the reply in the history, so the next turn renders
+// only what follows it, or drop the unanswered user turn and re-render next time
+void LLMInference::_recordTurn(bool keepReply) {
+    if (!_turnOpen) return;
+    _turnOpen = false;
+
+    if (keepReply && _storeChats && !_response.empty()) {
+        _addMessage(_response.c_str(), "assistant");
+        // Sequence 0 ends at the reply's last token. The reply's end-of-turn
+        // marker and whatever the template puts after it are left to the next
+        // turn's delta, so they are tokenized exactly as rendered.
+        int len = _formatMessages(false);
+        std::string rendered(_formattedMessages.begin(), _formattedMessages.begin() + std::max(len, 0));
+        size_t end = rendered.rfind(_response);
+        _prevRendered = end == std::string::npos ? std::string() : rendered.substr(0, end + _response.size());
+        return;
+    }
+
+    _popMessage();
+    _prevRendered.clear();
+}
+
+void LLMInference::addSystemPrompt(const char* prompt) {
+    std::lock_guard<std::mutex> lock(_ctxMutex);
+    _addMessage(prompt, "system");
+    setSystemPrompt(prompt);
+}
+
+// Changing the system prompt invalidates the cached prefix; it is re-primed lazily
+void LLMInference::setSystemPrompt(const char* prompt) {
+    if (!prompt || _systemPrompt == prompt) return;
+    _systemPrompt = prompt;
+    _prefixText.clear();
+    _prefixTokens.clear();
+    _prefixState.clear();
+}
+
 // Clear conversation history and reset context for a fresh conversation
 void LLMInference::startFreshConversation() {
     LOGI("Starting fresh conversation - clearing messages and context");
+    std::lock_guard<std::mutex> lock(_ctxMutex);
 
     // Clear all conversation messages
-    clearMessages();
+    _clearMessages();
 
     // Clear formatted message buffer
     _formattedMessages.clear();
     _formattedMessages.resize(_contextLength);
 
     // Reset other state
-    _prevLen = 0;
+    _prevRendered.clear();
+
+    // Keep the system prompt in the conversation for template mode
+    if (_chatTemplate != nullptr && !_systemPrompt.empty()) {
+        _addMessage(_systemPrompt.c_str(), "system");
+    }
+
+    // Seed sequence 0 with the cached system prompt KV instead of re-prefilling it
+    _applyPrefixCache();
 
     LOGI("Fresh conversation started");
 }
 
 void LLMInference::clearMessages() {
+    std::lock_guard<std::mutex> lock(_ctxMutex);
+    _clearMessages();
+}
+
+// Caller holds _ctxMutex
+void LLMInference::_clearMessages() {
     for (auto& msg : _messages) {
         free(const_cast<char*>(msg.role));
         free(const_cast<char*>(msg.content));
     }
     _messages.clear();
-    _prevLen = 0;
+    _prevRendered.clear();
+    _turnOpen = false;
+}
+
+// Rebuild the sampler chain and grammar only when the request's settings
+// differ. Returns false if the requested grammar does not compile.
+bool LLMInference::_applySamplerParams(const SamplerParams* sampling) {
+    if (!sampling) return true;
+
+    SamplerParams previous = _samplerParams;
+    _samplerParams = *sampling;
+
+    if (previous.grammar != _samplerParams.grammar || previous.jsonSchema != _samplerParams.jsonSchema) {
+        if (_grammar) {
+            llama_sampler_free(_grammar);
+            _grammar = nullptr;
+        }
+        if (!_samplerParams.grammar.empty()) {
+            _grammar = _grammarCache.acquire(llama_model_get_vocab(_model), _samplerParams.grammar,
+                                             _samplerParams.jsonSchema);
+            if (!_grammar) {
+                _samplerParams.grammar.clear();
+                _samplerParams.jsonSchema = false;
+                return false;
+            }
+        }
+    }
+
+    previous.grammar = _samplerParams.grammar;
+    previous.jsonSchema = _samplerParams.jsonSchema;
+    if (previous == _samplerParams && _sampler) return true;
+
+    if (_sampler) {
+        llama_sampler_free(_sampler);
+    }
+    _sampler = Sampling::createChain(_samplerParams);
+    LOGI("Sampler: temp=%.2f top_k=%d top_p=%.2f min_p=%.2f repeat=%.2f freq=%.2f presence=%.2f",
+         _samplerParams.temperature, _samplerParams.topK, _samplerParams.topP, _samplerParams.minP,
+         _samplerParams.repeatPenalty, _samplerParams.frequencyPenalty, _samplerParams.presencePenalty);
+    return true;
+}
+
+// Holds the context from here until stopCompletion: batched sessions then only
+// advance inside the chat's own decode steps
+bool LLMInference::startCompletion(const char* query, const PrefillCallback& onProgress,
+                                   const SamplerParams* sampling, const std::vector<std::string>& stop) {
+    // A previous turn's loop may still be running in the background (its
+    // caller went away); stop it before this turn takes sequence 0
+    if (_worker.joinable() && _worker.get_id() != std::this_thread::get_id()) {
+        {
+            std::lock_guard<std::mutex> lock(_ctxMutex);
+            if (_foregroundActive) requestCancel();
+        }
+        joinBackground();
+    }
+
+    std::unique_lock<std::mutex> lock(_ctxMutex);
+    _foregroundActive = true;
+    if (_startCompletion(query, onProgress, sampling, stop)) {
+        _deliverSessionOutputs(lock);
+        return true;
+    }
+    _recordTurn(false);
+    _foregroundActive = false;
+    _cancelRequested.store(false);
+    _deliverSessionOutputs(lock);
+    _sessionCv.notify_one();
+    return false;
 }
 
-bool LLMInference::startCompletion(const char* query) {
+bool LLMInference::_startCompletion(const char* query, const PrefillCallback& onProgress,
+                                    const SamplerParams* sampling, const std::vector<std::string>& stop) {
     if (!isReady()) {
         LOGE("Model not ready");
         return false;
     }
-
-    // Always clear previous state for fresh responses (no conversation continuity)
-    _prevLen = 0;
-    _formattedMessages.clear();
-    _formattedMessages.resize(llama_n_ctx(_ctx));
+    if (!_applySamplerParams(sampling)) {
+        LOGE("Grammar rejected");
+        return false;
+    }
 
     // Reset generation metrics
+    _completionStart = std::chrono::steady_clock::now();
+    float loadMs = _perf.loadMs;
+    float pageInMs = _perf.pageInMs;
+    float warmupMs = _perf.warmupMs;
+    _perf = PerfMetrics();
+    _perf.loadMs = loadMs;
+    _perf.pageInMs = pageInMs;
+    _perf.warmupMs = warmupMs;
+    _decodeLatenciesMs.clear();
+    _specDrafted = 0;
+    _specAccepted = 0;
     _responseGenerationTime = 0;
     _responseNumTokens = 0;
     _response.clear();
-    _utf8Cache.clear();
-
-    // Only clear previous messages when explicitly starting fresh conversation
-    // (_storeChats=true means maintain conversation history)
+    _utf8.clear();
+    _stopMatcher.reset(stop);
+    _eogPending = false;
 
-    // Use raw text approach - completely bypass templates
     std::string rawPrompt;
+    bool incremental = false;
     if (_chatTemplate != nullptr) {
-        // Template mode
-        int newLen = llama_chat_apply_template(
-            _chatTemplate,
-            _messages.data(),
-            _messages.size(),
-            true,  // add_generation_prompt
-            _formattedMessages.data(),
-            _formattedMessages.size()
-        );
-
-        if (newLen > (int)_formattedMessages.size()) {
-            _formattedMessages.resize(newLen);
-            newLen = llama_chat_apply_template(
-                _chatTemplate,
-                _messages.data(),
-                _messages.size(),
-                true,
-                _formattedMessages.data(),
-                _formattedMessages.size()
-            );
+        // Template mode: the query joins the history, and only the text rendered
+        // after what sequence 0 already holds (_prevRendered) is tokenized on top
+        // of the KV cache. A history rebuilt by the caller may lack the system
+        // message, so it is put in front whenever it is missing.
+        bool hasSystem = !_messages.empty() && strcmp(_messages.front().role, "system") == 0;
+        if (!hasSystem && !_systemPrompt.empty()) {
+            _messages.insert(_messages.begin(), {strdup("system"), strdup(_systemPrompt.c_str())});
+            _prevRendered.clear();
         }
+        _addMessage(query, "user");
+        _turnOpen = true;
 
+        int newLen = _formatMessages(true);
         if (newLen < 0) {
             LOGE("Chat template application failed with error code: %d", newLen);
-
-            // Fallback to raw text
-            rawPrompt = std::string(_messages[0].content);
-            LOGW("Using raw text fallback for template failure");
-        } else {
-            // Get prompt (only new part)
-            rawPrompt = std::string(_formattedMessages.begin() + _prevLen,
-                                   _formattedMessages.begin() + newLen);
+            return false;
         }
+        std::string rendered(_formattedMessages.begin(), _formattedMessages.begin() + newLen);
+        incremental = !_prevRendered.empty() && !_cacheTokens.empty() &&
+                      rendered.compare(0, _prevRendered.size(), _prevRendered) == 0;
+        rawPrompt = incremental ? rendered.substr(_prevRendered.size()) : std::move(rendered);
     } else {
         // Completely fresh raw generation - try a different approach
         std::string cleanQuery = std::string(query);
@@ -321,108 +807,175 @@ bool LLMInference::startCompletion(const char* query) {
 
         // Try a more explicit system prompt to break template addiction
         // Based on GitHub discussions, some models are hard-coded to respond in certain formats
-        rawPrompt = "You are a helpful assistant. User says: " + cleanQuery + ". Respond naturally as a human would, without any formatting, headers, or special tokens. Just give a direct answer.";
+        rawPrompt = _systemPrefixText() + " " + cleanQuery + ". Respond naturally as a human would, without any formatting, headers, or special tokens. Just give a direct answer.";
         LOGI("Using explicit anti-template prompt: %s", rawPrompt.c_str());
     }
 
-    // Tokenize the raw prompt
-    _promptTokens.clear();
-    _promptTokens.resize(rawPrompt.length() + 256);
-
-    int n_tokens = llama_tokenize(
-        llama_model_get_vocab(_model),
-        rawPrompt.c_str(),
-        rawPrompt.length(),
-        _promptTokens.data(),
-        _promptTokens.size(),
-        false,  // add_special - let the model handle it
-        false
-    );
-
-    if (n_tokens < 0) {
-        _promptTokens.resize(-n_tokens);
-        n_tokens = llama_tokenize(
-            llama_model_get_vocab(_model),
-            rawPrompt.c_str(),
-            rawPrompt.length(),
-            _promptTokens.data(),
-            _promptTokens.size(),
-            false,
-            false
-        );
+    if (incremental) {
+        // The cache holds the conversation through the last reply; the delta
+        // closes that reply and adds the new turn
+        _promptTokens = _cacheTokens;
+        std::vector<llama_token> delta = _tokenize(rawPrompt, false, true);
+        if (delta.empty()) {
+            _promptTokens.clear();
+        }
+        _promptTokens.insert(_promptTokens.end(), delta.begin(), delta.end());
+    } else {
+        _promptTokens = _tokenize(rawPrompt, _chatTemplate != nullptr, _chatTemplate != nullptr);
     }
 
-    if (n_tokens < 0) {
-        LOGE("Raw text tokenization failed");
+    if (_promptTokens.empty()) {
+        LOGE("Prompt tokenization failed");
         return false;
     }
-
-    _promptTokens.resize(n_tokens);
     
-    // Clear KV cache
     llama_memory_t mem = llama_get_memory(_ctx);
-    if (mem) {
-        llama_memory_clear(mem, false);
-        LOGI("KV cache cleared");
+    int n_ctx = llama_n_ctx(_ctx);
+    
+    // Leave 512 tokens of room for the response (cells held by batched sessions are taken)
+    int available = n_ctx - _sessionCells();
+    int limit = std::max(available - 512, available / 2);
+    if ((int)_promptTokens.size() > limit) {
+        if (!_contextShift) {
+            LOGE("Context overflow: %zu + 512 > %d", _promptTokens.size(), n_ctx);
+            return false;
+        }
+        _truncatePrompt(limit);
     }
     
-    // Reset sampler
-    llama_sampler_reset(_sampler);
+    // Reuse the longest token prefix already resident in the KV cache
+    size_t n_common = 0;
+    while (n_common < _cacheTokens.size() && n_common < _promptTokens.size() &&
+           _cacheTokens[n_common] == _promptTokens[n_common]) {
+        n_common++;
+    }
+    // Always decode at least one token so logits exist for sampling
+    if (n_common == _promptTokens.size() && n_common > 0) {
+        n_common--;
+    }
     
-    // Check context usage
-    _nCtxUsed = (int)(llama_memory_seq_pos_max(mem, 0) + 1);
-    int n_ctx = llama_n_ctx(_ctx);
-    LOGI("Context usage: %d / %d", _nCtxUsed, n_ctx);
+    // Drop the diverging tail (and any previously generated tokens past it)
+    _releaseForks((int)n_common);
+    if (!llama_memory_seq_rm(mem, 0, (llama_pos)n_common, -1)) {
+        LOGW("Partial KV removal not supported, clearing cache");
+        _clearCache();
+        n_common = 0;
+    }
+    _cacheTokens.resize(n_common);
     
-    if (_nCtxUsed + (int)_promptTokens.size() + 512 > n_ctx) {
-        LOGE("Context overflow: %d + %zu + 512 > %d", 
-             _nCtxUsed, _promptTokens.size(), n_ctx);
-        return false;
+    // Reset sampler (and grammar state, so the response starts from the root rule)
+    llama_sampler_reset(_sampler);
+    if (_grammar) {
+        llama_sampler_reset(_grammar);
     }
+    // Grammar-constrained output is already well-formed and must stay byte-exact
+    _filter.reset(_grammar == nullptr);
+    
+    _nReusedTokens = (int)n_common;
+    _nDecodedTokens = (int)(_promptTokens.size() - n_common);
+    LOGI("Prompt: %zu tokens (reused %d, decoding %d)",
+         _promptTokens.size(), _nReusedTokens, _nDecodedTokens);
     
-    // Decode prompt
-    llama_batch batch = llama_batch_get_one(_promptTokens.data(), _promptTokens.size());
-    if (llama_decode(_ctx, batch) != 0) {
-        LOGE("Failed to decode prompt");
+    // Decode only the new suffix, chunk by chunk
+    if (!_decodeChunked(_promptTokens.data() + n_common, _nDecodedTokens, onProgress)) {
+        if (!_prefillCancelled) {
+            LOGE("Failed to decode prompt");
+        }
         return false;
     }
+    LOGI("Context usage: %d / %d", _nCtxUsed, n_ctx);
     
+    _specQueue.clear();
+    _hasCarry = false;
+    _generationStart = std::chrono::steady_clock::now();
+    _lastTokenTime = _generationStart;
+
     LOGI("Generation started");
     return true;
 }
 
+// One generation step, timed end to end (sample, detokenize and decode), so
+// tokens/sec reflects the forward pass rather than just sampling
 std::string LLMInference::completionLoop() {
+    auto start = std::chrono::steady_clock::now();
+    std::string result;
+    {
+        std::unique_lock<std::mutex> lock(_ctxMutex);
+        result = _completionStep();
+        _deliverSessionOutputs(lock);
+    }
+    if (result == "[EOG]" || result == "[ERROR]") {
+        return result;
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    _responseGenerationTime += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    _lastTokenTime = end;
+    if (_responseNumTokens == 1 && _perf.ttftMs == 0) {
+        _perf.ttftMs = std::chrono::duration<float, std::milli>(end - _completionStart).count();
+    }
+    return result;
+}
+
+std::string LLMInference::_completionStep() {
     if (!isReady()) {
         return "[ERROR]";
     }
+    if (_eogPending) {
+        return "[EOG]";
+    }
 
-    auto start = std::chrono::steady_clock::now();
+    // Stop requested from another thread: finish as if EOG was sampled
+    if (_cancelRequested.load()) {
+        LOGI("Generation cancelled (%ld tokens)", _responseNumTokens);
+        return "[EOG]";
+    }
 
-    // Sample token
-    _currToken = llama_sampler_sample(_sampler, _ctx, -1);
-    llama_sampler_accept(_sampler, _currToken);
+    // Make room for the next token
+    if (_specQueue.empty() &&
+        (int)_cacheTokens.size() + _sessionCells() >= (int)llama_n_ctx(_ctx) &&
+        !(_contextShift && _shiftContext())) {
+        LOGW("Context full (%zu tokens), ending generation", _cacheTokens.size());
+        return "[EOG]";
+    }
+
+    // Next token: one verified by a speculative step (already decoded), a carried
+    // over sample from the last verification, or a fresh sample. Speculation is
+    // skipped while batched sessions are active so they can share each step.
+    bool preDecoded = false;
+    if (_specQueue.empty() && (_draftCtx || _promptLookup) && _sessions.empty() &&
+        _speculativeStep() == SpecStep::Failed) {
+        LOGE("Verification decode failed");
+        return "[ERROR]";
+    }
+    if (!_specQueue.empty()) {
+        _currToken = _specQueue.front();
+        _specQueue.pop_front();
+        preDecoded = true;
+    } else if (_hasCarry) {
+        _currToken = _carryToken;
+        _hasCarry = false;
+    } else {
+        _currToken = _sample(_mainLogitsIdx);
+    }
 
     // Check for EOS
     if (llama_vocab_is_eog(llama_model_get_vocab(_model), _currToken)) {
-        LOGI("End of generation (%d tokens)", _responseNumTokens);
-        // Flush any remaining UTF-8 cache
-        if (!_utf8Cache.empty()) {
-            _response += _utf8Cache;
-            std::string result = _utf8Cache;
-            _utf8Cache.clear();
-            if (_storeChats) {
-                addChatMessage((_response).c_str(), "assistant");
-            }
-            // No more tokens to decode
-            return result;
+        LOGI("End of generation (%ld tokens)", _responseNumTokens);
+        if (preDecoded) {
+            _dropQueuedTokens();
         }
-        if (_storeChats) {
-            addChatMessage(_response.c_str(), "assistant");
+        // Flush a dangling partial character and text held back for matching
+        bool stopped;
+        std::string text = _stopMatcher.feed(_utf8.flush(), stopped);
+        if (!stopped) {
+            text += _stopMatcher.finish();
         }
-        return "[EOG]";
+        return _finishResponse(text);
     }
 
     // Convert to text
+    auto detokStart = std::chrono::steady_clock::now();
     char piece[256];
     int n_chars = llama_token_to_piece(
         llama_model_get_vocab(_model),
@@ -432,252 +985,980 @@ std::string LLMInference::completionLoop() {
         0,
         false
     );
-
-    auto end = std::chrono::steady_clock::now();
-    _responseGenerationTime += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    _perf.detokenizeMs += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - detokStart).count();
     _responseNumTokens++;
 
     if (n_chars > 0 && n_chars < (int)sizeof(piece)) {
-        piece[n_chars] = '\0';
-        _utf8Cache += piece;
-
-        // Always emit the token piece - trie to build valid UTF-8 progressively
-        // If it's complete UTF-8, emit it immediately
-        if (_isValidUtf8(_utf8Cache.c_str())) {
-            _response += _utf8Cache;
-            std::string result = _utf8Cache;
-            _utf8Cache.clear();
-
-            // Decode next token
-            llama_batch next_batch = llama_batch_get_one(&_currToken, 1);
-            if (llama_decode(_ctx, next_batch) != 0) {
-                LOGE("Decode failed");
-                return "[ERROR]";
+        // Only whole characters are emitted; a split multibyte character is
+        // carried over to the next token
+        bool stopped;
+        std::string text = _stopMatcher.feed(_utf8.push(std::string(piece, n_chars)), stopped);
+        if (stopped) {
+            LOGI("Stop sequence matched (%ld tokens)", _responseNumTokens);
+            if (preDecoded) {
+                _dropQueuedTokens();
             }
+            return _finishResponse(text);
+        }
+        std::string result = _filter.feed(text);
+        _response += result;
 
-            return result;
-        } else {
-            // Not complete UTF-8 yet, but emit anyway as tokens should align to char boundaries
-            _response += _utf8Cache;
-            std::string result = _utf8Cache;
-            _utf8Cache.clear();
-
-            // Decode next token
-            llama_batch next_batch = llama_batch_get_one(&_currToken, 1);
-            llama_decode(_ctx, next_batch);
-
-            return result;
+        // Decode next token
+        if (!preDecoded && !_decodeToken(_currToken)) {
+            LOGE("Decode failed");
+            return "[ERROR]";
         }
+
+        return result;
     }
 
     // No valid text piece, just decode next token
-    llama_batch next_batch = llama_batch_get_one(&_currToken, 1);
-    llama_decode(_ctx, next_batch);
+    if (!preDecoded) {
+        _decodeToken(_currToken);
+    }
 
     return "";
 }
 
-std::string LLMInference::postProcessResponse(const std::string& rawResponse) {
-    std::string processed = rawResponse;
-
-    // Remove Llama chat template special tokens and other formatting artifacts
-    // Patterns to remove:
-    // <|start_header_id|>role<|end_header_id|>
-    // <|eot_id|>
-    // {{{{
-    // |_|
-    // Lines that look like timestamps or metadata: "Little • snow •, [29-10-2025...]"
-    // Repeated or malformed formatting
-
-    // Remove timestamp-like patterns that appear in responses
-    size_t pos = 0;
-    while ((pos = processed.find("Little • snow •, [")) != std::string::npos) {
-        size_t endBracket = processed.find("]", pos);
-        if (endBracket != std::string::npos) {
-            // Remove the entire metadata line including newline
-            size_t lineEnd = endBracket;
-            if (lineEnd + 1 < processed.length() && processed[lineEnd + 1] == '\n') {
-                lineEnd++;
-            }
-            if (lineEnd + 1 < processed.length() && processed[lineEnd + 1] == '\r') {
-                lineEnd++;
-            }
-            processed.erase(pos, lineEnd - pos + 1);
-        } else {
-            pos += 15;
+// Ends the response at EOG or a stop string. Text still held back is returned
+// first, with EOG reported on the next step.
+std::string LLMInference::_finishResponse(const std::string& text) {
+    std::string result = _filter.feed(text);
+    result += _filter.finish();
+    _response += result;
+    if (!result.empty()) {
+        _eogPending = true;
+        return result;
+    }
+    return "[EOG]";
+}
+
+bool LLMInference::loadDraftModel(const char* modelPath, int nDraft) {
+    if (!isReady()) {
+        LOGE("Load the main model before the draft model");
+        return false;
+    }
+    freeDraftModel();
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.use_mmap = true;
+    _draftModel = llama_model_load_from_file(modelPath, model_params);
+    if (!_draftModel) {
+        LOGE("Failed to load draft model from %s", modelPath);
+        return false;
+    }
+
+    // Draft tokens are fed straight to the main model, so the vocabularies must line up
+    const llama_vocab* mainVocab = llama_model_get_vocab(_model);
+    const llama_vocab* draftVocab = llama_model_get_vocab(_draftModel);
+    int vocabDiff = std::abs(llama_vocab_n_tokens(mainVocab) - llama_vocab_n_tokens(draftVocab));
+    if (vocabDiff > 128 || llama_vocab_bos(mainVocab) != llama_vocab_bos(draftVocab)) {
+        LOGE("Draft model vocabulary does not match the main model");
+        freeDraftModel();
+        return false;
+    }
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = llama_n_ctx(_ctx);
+    ctx_params.n_batch = llama_n_batch(_ctx);
+    ctx_params.n_ubatch = ctx_params.n_batch;
+    ctx_params.n_threads = _threads;
+    ctx_params.n_threads_batch = _batchThreads;
+    _draftCtx = llama_init_from_model(_draftModel, ctx_params);
+    if (!_draftCtx) {
+        LOGE("Failed to create draft context");
+        freeDraftModel();
+        return false;
+    }
+    llama_set_abort_callback(_draftCtx, _abortCallback, this);
+    // Draft and main decodes alternate on one thread, so they share the workers
+    if (_threadpool) {
+        llama_attach_threadpool(_draftCtx, _threadpool, _threadpoolBatch);
+    }
+
+    _nDraft = std::max(1, nDraft);
+    _ensureSpecBatch();
+    _specDrafted = 0;
+    _specAccepted = 0;
+
+    LOGI("Draft model loaded: %s (%d tokens per step)", modelPath, _nDraft);
+    return true;
+}
+
+void LLMInference::freeDraftModel() {
+    if (_specBatch.token && !_promptLookup) {
+        llama_batch_free(_specBatch);
+        _specBatch = {};
+        _specBatchCapacity = 0;
+    }
+    if (_draftCtx) {
+        llama_free(_draftCtx);
+        _draftCtx = nullptr;
+    }
+    if (_draftModel) {
+        llama_model_free(_draftModel);
+        _draftModel = nullptr;
+    }
+    _draftCacheTokens.clear();
+    _specQueue.clear();
+    _hasCarry = false;
+}
+
+void LLMInference::setPromptLookup(bool enabled, int ngramMax, int nDraft) {
+    _promptLookup = enabled;
+    // A single-token key matches almost anywhere and mostly drafts noise
+    _lookupNgramMax = std::max(2, ngramMax);
+    _nDraft = std::max(1, nDraft);
+    // A loaded draft model also verifies _nDraft + 1 tokens per step
+    _ensureSpecBatch();
+    LOGI("Prompt lookup decoding %s (ngram<=%d, %d tokens per step)",
+         enabled ? "enabled" : "disabled", _lookupNgramMax, _nDraft);
+}
+
+void LLMInference::_ensureSpecBatch() {
+    if (_specBatchCapacity >= _nDraft + 1) return;
+    if (_specBatch.token) {
+        llama_batch_free(_specBatch);
+    }
+    _specBatch = llama_batch_init(_nDraft + 1, 0, 1);
+    _specBatchCapacity = _nDraft + 1;
+}
+
+// Bring the draft KV cache in line with the main sequence followed by `next`
+bool LLMInference::_syncDraft(llama_token next) {
+    std::vector<llama_token> target = _cacheTokens;
+    target.push_back(next);
+
+    size_t n_common = 0;
+    while (n_common < _draftCacheTokens.size() && n_common < target.size() &&
+           _draftCacheTokens[n_common] == target[n_common]) {
+        n_common++;
+    }
+    if (n_common == target.size()) {
+        n_common--;  // Re-decode the last token so the draft has fresh logits
+    }
+
+    llama_memory_t mem = llama_get_memory(_draftCtx);
+    if (!llama_memory_seq_rm(mem, 0, (llama_pos)n_common, -1)) {
+        llama_memory_clear(mem, false);
+        n_common = 0;
+    }
+    _draftCacheTokens.resize(n_common);
+
+    int chunk = (int)llama_n_batch(_draftCtx);
+    for (size_t i = n_common; i < target.size(); i += chunk) {
+        int n = std::min(chunk, (int)(target.size() - i));
+        if (llama_decode(_draftCtx, llama_batch_get_one(target.data() + i, n)) != 0) {
+            llama_memory_clear(mem, false);
+            _draftCacheTokens.clear();
+            return false;
         }
+        _draftCacheTokens.insert(_draftCacheTokens.end(), target.begin() + i, target.begin() + i + n);
+    }
+    return true;
+}
+
+// Let the draft model propose up to _nDraft greedy continuations of `first`
+std::vector<llama_token> LLMInference::_draftWithModel(llama_token first) {
+    std::vector<llama_token> drafts;
+    if (!_syncDraft(first)) {
+        return drafts;
+    }
+
+    const llama_vocab* vocab = llama_model_get_vocab(_model);
+    int nMainVocab = llama_vocab_n_tokens(vocab);
+    int nDraftVocab = llama_vocab_n_tokens(llama_model_get_vocab(_draftModel));
+    for (int k = 0; k < _nDraft; ++k) {
+        const float* logits = llama_get_logits_ith(_draftCtx, -1);
+        llama_token best = (llama_token)(std::max_element(logits, logits + nDraftVocab) - logits);
+        if (best >= nMainVocab) break;
+        drafts.push_back(best);
+        if (llama_vocab_is_eog(vocab, best) || k + 1 == _nDraft) break;
+
+        if (llama_decode(_draftCtx, llama_batch_get_one(&best, 1)) != 0) break;
+        _draftCacheTokens.push_back(best);
     }
+    return drafts;
+}
 
-    // Remove <|start_header_id|>... <|end_header_id|> patterns
-    pos = 0;
-    while ((pos = processed.find("<|start_header_id|>", pos)) != std::string::npos) {
-        size_t endHeader = processed.find("<|end_header_id|>", pos);
-        if (endHeader != std::string::npos) {
-            endHeader += 17; // length of "<|end_header_id|>"
-            // Remove the entire header block including any trailing newlines
-            size_t blockEnd = endHeader;
-            while (blockEnd < processed.length() && (processed[blockEnd] == '\n' || processed[blockEnd] == '\r')) {
-                blockEnd++;
+// Prompt lookup: find the most recent earlier occurrence of the trailing n-gram
+// (longest first) in the prompt + generated history and propose what followed it.
+// Rewrite/summarize prompts copy long spans, so this often matches several tokens.
+std::vector<llama_token> LLMInference::_draftWithLookup(llama_token first) const {
+    std::vector<llama_token> drafts;
+    int n = (int)_cacheTokens.size() + 1;
+    auto at = [this, first, n](int i) { return i == n - 1 ? first : _cacheTokens[i]; };
+
+    for (int ngram = std::min(_lookupNgramMax, n - 1); ngram >= 1; --ngram) {
+        for (int start = n - ngram - 1; start >= 0; --start) {
+            int j = 0;
+            while (j < ngram && at(start + j) == at(n - ngram + j)) {
+                j++;
             }
-            processed.erase(pos, blockEnd - pos);
-        } else {
-            pos += 18; // length of "<|start_header_id|>"
+            if (j < ngram) continue;
+
+            for (int k = start + ngram; k < n && (int)drafts.size() < _nDraft; ++k) {
+                drafts.push_back(at(k));
+            }
+            return drafts;
         }
     }
+    return drafts;
+}
+
+// Take the next main-model token, draft up to _nDraft more (draft model or
+// prompt lookup), verify them all in one batched decode and queue the accepted
+// run. Skipped (queuing nothing) when there is nothing worth verifying or the
+// verify decode was cancelled; Failed when it errored and the cache was cleared.
+LLMInference::SpecStep LLMInference::_speculativeStep() {
+    int nPast = (int)_cacheTokens.size();
+    if (nPast + _nDraft + 1 > (int)llama_n_ctx(_ctx)) {
+        return SpecStep::Skipped;
+    }
+
+    const llama_vocab* vocab = llama_model_get_vocab(_model);
+    llama_token first = _hasCarry ? _carryToken : _sample(_mainLogitsIdx);
+    _carryToken = first;
+    _hasCarry = true;  // Until it is decoded below
+
+    if (llama_vocab_is_eog(vocab, first)) {
+        return SpecStep::Skipped;
+    }
+
+    std::vector<llama_token> drafts = _draftCtx ? _draftWithModel(first) : _draftWithLookup(first);
+    if (drafts.empty()) {
+        return SpecStep::Skipped;  // A plain single-token decode is cheaper
+    }
 
-    // Remove any remaining individual template tokens
-    std::vector<std::string> tokensToRemove = {
-        "<|end_header_id|>",
-        "<|eot_id|>",
-        "<|start_header_id|>",
-        "<|eot_id|>",
-        "`python",
-        "`",
-        "<|eot_id|>",
-        "_<|start_header_id|>_",
-        "<|start_header_id|>_"
+    // Verify [first, drafts...] in a single main-model decode
+    _specBatch.n_tokens = 0;
+    auto addToBatch = [this, nPast](llama_token token) {
+        int i = _specBatch.n_tokens++;
+        _specBatch.token[i] = token;
+        _specBatch.pos[i] = nPast + i;
+        _specBatch.n_seq_id[i] = 1;
+        _specBatch.seq_id[i][0] = 0;
+        _specBatch.logits[i] = true;
     };
+    addToBatch(first);
+    for (llama_token token : drafts) {
+        addToBatch(token);
+    }
+
+    float elapsedMs = 0;
+    int rc = _decode(_specBatch, elapsedMs);
+    if (rc != 0) {
+        if (rc == 2 && _cancelRequested.load()) {
+            _trimCacheToTokens();
+            return SpecStep::Skipped;
+        }
+        _clearCache();
+        return SpecStep::Failed;
+    }
+
+    _hasCarry = false;
+    _cacheTokens.push_back(first);
+    _specQueue.push_back(first);
+
+    // Accept drafts while the main model's own choice agrees; the first
+    // disagreement (or the token after a fully accepted run) is carried over
+    size_t accepted = 0;
+    for (size_t i = 0; i <= drafts.size(); ++i) {
+        llama_token sampled = _sample((int)i);
+        if (i == drafts.size() || sampled != drafts[i]) {
+            _carryToken = sampled;
+            _hasCarry = true;
+            break;
+        }
+        _cacheTokens.push_back(sampled);
+        _specQueue.push_back(sampled);
+        accepted++;
+        if (llama_vocab_is_eog(vocab, sampled)) break;
+    }
+
+    // Drop the rejected drafts from the main KV cache
+    _trimCacheToTokens();
+    _nCtxUsed = (int)_cacheTokens.size();
+
+    // Spread the verification cost over the tokens it produced
+    int produced = (int)accepted + 1;
+    _perf.decodeTokens += produced;
+    _perf.decodeMs += elapsedMs;
+    _decodeLatenciesMs.insert(_decodeLatenciesMs.end(), produced, elapsedMs / produced);
+
+    _specDrafted += (long)drafts.size();
+    _specAccepted += (long)accepted;
+    return SpecStep::Queued;
+}
 
-    for (const auto& token : tokensToRemove) {
-        pos = 0;
-        while ((pos = processed.find(token, pos)) != std::string::npos) {
-            processed.erase(pos, token.length());
-        }
-    }
-
-    // Remove malformed brackets and separators like `_"}}}` `}}}}` and similar junk
-    std::vector<std::string> junkPatterns = {
-        "_\"}}",  // Common malformed ending patterns
-        "}}}}",
-        "{{{{",
-        "|>>_",
-        "_|\">",
-        "|\">",
-        "|>",
-        "|\"\"/>",
-        "|\">",
-        "_|\">",
-        "|\">|\">",
-        "\"}}`",
-        "`\"",
-        "_\"}}}}",
-        "}}}}`",
-        "\"}}}}"
+// EOG came out of the speculative queue: forget it and anything decoded after it
+void LLMInference::_dropQueuedTokens() {
+    size_t drop = std::min(_specQueue.size() + 1, _cacheTokens.size());
+    _cacheTokens.resize(_cacheTokens.size() - drop);
+    _trimCacheToTokens();
+    _nCtxUsed = (int)_cacheTokens.size();
+    _specQueue.clear();
+    _hasCarry = false;
+}
+
+float LLMInference::getDraftAcceptanceRate() const {
+    return _specDrafted > 0 ? (float)_specAccepted / (float)_specDrafted : 0.0f;
+}
+
+// Tokens per second of wall time since prefill finished (includes decode and verification)
+float LLMInference::getEffectiveTokensPerSecond() const {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(_lastTokenTime - _generationStart).count();
+    return (_responseNumTokens > 0 && us > 0) ? (float)_responseNumTokens / (us / 1e6f) : 0.0f;
+}
+
+// Run the sample/decode loop until EOG, maxTokens or cancellation, handing text
+// to onText in batches so callers pay one callback per batch instead of per token
+int LLMInference::generate(const GenerationOptions& options, const TextCallback& onText) {
+    std::string pending;
+    int pendingTokens = 0;
+    int numTokens = 0;
+    auto lastFlush = std::chrono::steady_clock::now();
+
+    auto flush = [&]() {
+        bool keepGoing = pending.empty() || onText(pending);
+        pending.clear();
+        pendingTokens = 0;
+        lastFlush = std::chrono::steady_clock::now();
+        return keepGoing;
     };
 
-    for (const auto& junk : junkPatterns) {
-        pos = 0;
-        while ((pos = processed.find(junk, pos)) != std::string::npos) {
-            processed.erase(pos, junk.length());
+    while (numTokens < options.maxTokens) {
+        std::string piece = completionLoop();
+        if (piece == "[EOG]") {
+            break;
+        }
+        if (piece == "[ERROR]") {
+            flush();
+            return -1;
+        }
+        numTokens++;
+        pending += piece;
+        pendingTokens++;
+
+        auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - lastFlush).count();
+        if ((pendingTokens >= options.flushTokens || elapsedMs >= options.flushIntervalMs) && !flush()) {
+            requestCancel();
+            break;
+        }
+    }
+
+    flush();
+    return numTokens;
+}
+
+// One background task at a time; waits for the previous one to finish first
+void LLMInference::runInBackground(std::function<void()> task) {
+    joinBackground();
+    _worker = std::thread(std::move(task));
+}
+
+void LLMInference::joinBackground() {
+    if (!_worker.joinable()) return;
+    if (_worker.get_id() == std::this_thread::get_id()) {
+        // Called from the task itself (e.g. a completion callback): can't join ourselves
+        _worker.detach();
+        return;
+    }
+    _worker.join();
+}
+
+// Queue a conversation on a free sequence. Its prompt is prefilled in chunks
+// that share batches with whatever else is decoding, then it generates up to
+// maxTokens, one token per shared step.
+int LLMInference::openSession(const char* prompt, int maxTokens, SessionCallback onText) {
+    if (!isReady() || !prompt) {
+        return -1;
+    }
+    std::vector<llama_token> tokens = _tokenize(prompt);
+    if (tokens.empty() || (int)tokens.size() >= (int)llama_n_ctx(_ctx) / 2) {
+        LOGE("Session prompt rejected (%zu tokens)", tokens.size());
+        return -1;
+    }
+
+    int id = -1;
+    {
+        std::unique_lock<std::mutex> lock(_ctxMutex);
+        _reapSessions();
+        BatchSession* session = _newSession(maxTokens, std::move(onText));
+        if (session) {
+            session->prompt = std::move(tokens);
+            id = session->id;
         }
+        _deliverSessionOutputs(lock);
     }
+    if (id < 0) {
+        return -1;
+    }
+    _sessionCv.notify_one();
 
-    // Remove multiple curly braces {{{{ (4 or more)
-    pos = 0;
-    while (pos < processed.length()) {
-        if (processed[pos] == '{') {
-            size_t braceEnd = pos;
-            while (braceEnd < processed.length() && processed[braceEnd] == '{') {
-                braceEnd++;
+    LOGI("Session %d opened", id);
+    return id;
+}
+
+// Prefill the query once on sequence 0, then fork it into n candidate sessions
+// that share the prompt's KV cells and sample independently. The candidates
+// decode together in one batch per step; sequence 0 keeps the prompt for reuse.
+std::vector<int> LLMInference::startCandidates(const char* query, int n, int maxTokens,
+                                               const PrefillCallback& onProgress,
+                                               const SessionCallback& onText,
+                                               const SamplerParams* sampling) {
+    std::vector<int> ids;
+    std::unique_lock<std::mutex> lock(_ctxMutex);
+    if (_foregroundActive) {
+        LOGE("Candidates rejected: a chat turn is in progress");
+        return ids;
+    }
+    _foregroundActive = true;
+
+    if (_startCompletion(query, onProgress, sampling, {})) {
+        llama_memory_t mem = llama_get_memory(_ctx);
+        int nPast = (int)_cacheTokens.size();
+        _reapSessions();
+
+        for (int i = 0; i < n; ++i) {
+            BatchSession* session = _newSession(maxTokens, onText);
+            if (!session) break;
+            llama_memory_seq_cp(mem, 0, session->id, -1, -1);
+            session->nPast = nPast;
+            session->nShared = nPast;
+            ids.push_back(session->id);
+        }
+
+        // Every candidate's first token comes from the same prompt logits
+        for (auto& session : _sessions) {
+            if (std::find(ids.begin(), ids.end(), session->id) != ids.end()) {
+                session->batchIdx = _mainLogitsIdx;
+                _sampleSession(*session);
+                session->batchIdx = -1;
             }
-            if (braceEnd - pos >= 4) { // Remove groups of 4 or more braces
-                processed.erase(pos, braceEnd - pos);
-            } else {
-                pos = braceEnd;
+        }
+        LOGI("Forked %zu candidates from a %d token prompt", ids.size(), nPast);
+    }
+    // Candidates are side answers; the chat history does not take the query
+    _recordTurn(false);
+
+    _foregroundActive = false;
+    _cancelRequested.store(false);
+    _deliverSessionOutputs(lock);
+    _sessionCv.notify_one();
+    return ids;
+}
+
+// New session on a free sequence ID; caller holds _ctxMutex
+LLMInference::BatchSession* LLMInference::_newSession(int maxTokens, SessionCallback onText) {
+    int id = -1;
+    int nSeq = std::min(kMaxSequences, (int)llama_n_seq_max(_ctx));
+    for (int seq = 1; seq < nSeq && id < 0; ++seq) {
+        bool used = std::any_of(_sessions.begin(), _sessions.end(),
+                                [seq](const std::unique_ptr<BatchSession>& s) { return s->id == seq; });
+        if (!used) id = seq;
+    }
+    if (id < 0) {
+        LOGW("No free sequence for a new session");
+        return nullptr;
+    }
+
+    auto session = std::make_unique<BatchSession>();
+    session->id = id;
+    // Each session walks the grammar from its root rule on its own clone
+    if (!_samplerParams.grammar.empty()) {
+        session->grammar = _grammarCache.acquire(llama_model_get_vocab(_model), _samplerParams.grammar,
+                                                 _samplerParams.jsonSchema);
+        if (!session->grammar) {
+            LOGE("Grammar rejected for session %d", id);
+            return nullptr;
+        }
+        // Constrained output must stay byte-exact
+        session->filter.reset(false);
+    }
+    // A fixed seed still has to give each session its own stream
+    SamplerParams params = _samplerParams;
+    if (params.seed != LLAMA_DEFAULT_SEED) {
+        params.seed += (uint32_t)id;
+    }
+    session->sampler = Sampling::createChain(params);
+    session->maxTokens = std::max(1, maxTokens);
+    session->onText = std::make_shared<SessionCallback>(std::move(onText));
+    _sessions.push_back(std::move(session));
+
+    if (!_schedulerThread.joinable()) {
+        _schedulerThread = std::thread(&LLMInference::_schedulerLoop, this);
+    }
+    return _sessions.back().get();
+}
+
+// Only flags the session; its cells and sampler are released on the next step
+void LLMInference::closeSession(int sessionId) {
+    std::lock_guard<std::mutex> lock(_ctxMutex);
+    for (auto& session : _sessions) {
+        if (session->id == sessionId) {
+            session->closed->store(true);
+        }
+    }
+    _sessionCv.notify_one();
+}
+
+int LLMInference::getActiveSessionCount() {
+    std::lock_guard<std::mutex> lock(_ctxMutex);
+    return (int)std::count_if(_sessions.begin(), _sessions.end(),
+                              [](const std::unique_ptr<BatchSession>& s) { return !s->finished && !s->closed->load(); });
+}
+
+bool LLMInference::_hasRunnableSessions() const {
+    for (const auto& s : _sessions) {
+        if (!s->finished && !s->closed->load() && (s->hasNext || s->prefilled < s->prompt.size())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int LLMInference::_sessionCells() const {
+    int cells = 0;
+    for (const auto& s : _sessions) {
+        cells += s->nPast - s->nShared;
+    }
+    return cells;
+}
+
+// The chat's next token at row 0 plus one step of every batched session, in one decode
+bool LLMInference::_decodeTokenWithSessions(llama_token token) {
+    _sessionBatch.n_tokens = 1;
+    _sessionBatch.token[0] = token;
+    _sessionBatch.pos[0] = (llama_pos)_cacheTokens.size();
+    _sessionBatch.n_seq_id[0] = 1;
+    _sessionBatch.seq_id[0][0] = 0;
+    _sessionBatch.logits[0] = true;
+    _fillSessionBatch();
+
+    float elapsedMs = 0;
+    int rc = _decode(_sessionBatch, elapsedMs);
+    _finishSessionStep(rc);
+    if (rc == 2 && _cancelRequested.load()) {
+        _trimCacheToTokens();
+        return true;
+    }
+    if (rc != 0) {
+        _clearCache();
+        return false;
+    }
+
+    _mainLogitsIdx = 0;
+    _perf.decodeTokens++;
+    _perf.decodeMs += elapsedMs;
+    _decodeLatenciesMs.push_back(elapsedMs);
+    _cacheTokens.push_back(token);
+    _nCtxUsed = (int)_cacheTokens.size();
+    return true;
+}
+
+// Append one step of every runnable session to _sessionBatch: generating
+// sessions first (one token each keeps their latency flat), then prompt chunks
+// in whatever room is left. A prompt contributes at most _prefillChunk tokens
+// per step, so a long one is spread over several steps instead of stalling
+// the chat's token behind a full batch. Sessions that no longer fit end.
+void LLMInference::_fillSessionBatch() {
+    int capacity = (int)llama_n_batch(_ctx);
+    int freeCells = (int)llama_n_ctx(_ctx) - (int)_cacheTokens.size() - _sessionCells() - _sessionBatch.n_tokens;
+
+    auto add = [this](llama_token token, int pos, int seq, bool logits) {
+        int i = _sessionBatch.n_tokens++;
+        _sessionBatch.token[i] = token;
+        _sessionBatch.pos[i] = pos;
+        _sessionBatch.n_seq_id[i] = 1;
+        _sessionBatch.seq_id[i][0] = seq;
+        _sessionBatch.logits[i] = logits;
+        return i;
+    };
+
+    for (auto& s : _sessions) {
+        s->stepPrompt = 0;
+        s->stepNext = false;
+        s->batchIdx = -1;
+        if (s->finished || s->closed->load() || !s->hasNext || _sessionBatch.n_tokens >= capacity) {
+            continue;
+        }
+        if (freeCells <= 0) {
+            LOGW("Context full, ending session %d", s->id);
+            _finishSession(*s);
+            continue;
+        }
+        s->batchIdx = add(s->next, s->nPast, s->id, true);
+        s->stepNext = true;
+        freeCells--;
+    }
+
+    for (auto& s : _sessions) {
+        if (s->finished || s->closed->load() || s->prefilled >= s->prompt.size()) {
+            continue;
+        }
+        if (freeCells <= 0) {
+            LOGW("Context full, ending session %d", s->id);
+            _finishSession(*s);
+            continue;
+        }
+        int n = std::min({(int)(s->prompt.size() - s->prefilled), _prefillChunk,
+                          capacity - _sessionBatch.n_tokens, freeCells});
+        if (n <= 0) {
+            continue;
+        }
+        for (int k = 0; k < n; ++k) {
+            bool last = s->prefilled + k + 1 == s->prompt.size();
+            int i = add(s->prompt[s->prefilled + k], s->nPast + k, s->id, last);
+            if (last) s->batchIdx = i;
+        }
+        s->stepPrompt = n;
+        freeCells -= n;
+    }
+}
+
+// Commit (or roll back) the sessions' part of a shared decode and sample their next tokens
+void LLMInference::_finishSessionStep(int rc) {
+    llama_memory_t mem = llama_get_memory(_ctx);
+    for (auto& s : _sessions) {
+        if (s->stepPrompt == 0 && !s->stepNext) {
+            continue;
+        }
+        if (rc != 0) {
+            // Drop whatever part of the step reached the cache; an abort is retried next step
+            llama_memory_seq_rm(mem, s->id, s->nPast, -1);
+            if (rc != 2) {
+                LOGE("Batched decode failed (%d), ending session %d", rc, s->id);
+                _finishSession(*s);
             }
         } else {
-            pos++;
+            s->nPast += s->stepPrompt + (s->stepNext ? 1 : 0);
+            s->prefilled += s->stepPrompt;
+            if (s->stepNext) s->hasNext = false;
+            if (s->batchIdx >= 0) _sampleSession(*s);
         }
+        s->stepPrompt = 0;
+        s->stepNext = false;
+        s->batchIdx = -1;
     }
+}
 
-    // Clean up excessive newlines - replace 3+ consecutive newlines with 2
-    pos = 0;
-    while ((pos = processed.find("\n\n\n", pos)) != std::string::npos) {
-        processed.replace(pos, 3, "\n\n");
+void LLMInference::_sampleSession(BatchSession& session) {
+    const llama_vocab* vocab = llama_model_get_vocab(_model);
+    llama_token token = session.grammar
+        ? Sampling::sampleConstrained(session.sampler, session.grammar, _ctx, session.batchIdx, _candidates)
+        : llama_sampler_sample(session.sampler, _ctx, session.batchIdx);
+    if (llama_vocab_is_eog(vocab, token)) {
+        _finishSession(session);
+        return;
     }
 
-    // Remove lines that contain only special characters or are clearly junk
-    std::stringstream ss(processed);
-    std::string line;
-    std::string cleaned;
-    bool firstLine = true;
+    char piece[256];
+    int n = llama_token_to_piece(vocab, token, piece, sizeof(piece), 0, false);
+    session.generated++;
+    session.next = token;
+    session.hasNext = true;
+
+    std::string text = n > 0 && n < (int)sizeof(piece) ? session.filter.feed(session.utf8.push(std::string(piece, n)))
+                                                       : std::string();
+    _queueSessionOutput(session, std::move(text), false);
+    if (session.generated >= session.maxTokens) {
+        _finishSession(session);
+    }
+}
 
-    while (std::getline(ss, line)) {
-        // Skip lines that are mostly special characters or template remnants
-        bool isJunk = false;
+void LLMInference::_finishSession(BatchSession& session) {
+    if (session.finished) return;
+    session.finished = true;
+    session.hasNext = false;
+    LOGI("Session %d finished (%d tokens)", session.id, session.generated);
+    std::string tail = session.filter.feed(session.utf8.flush());
+    tail += session.filter.finish();
+    if (!tail.empty()) {
+        _queueSessionOutput(session, std::move(tail), false);
+    }
+    _queueSessionOutput(session, std::string(), true);
+}
 
-        // Check if line contains only special chars and whitespace
-        bool hasAlpha = false;
-        int specialCount = 0;
+// Caller holds _ctxMutex
+void LLMInference::_queueSessionOutput(BatchSession& session, std::string text, bool finished) {
+    if (!session.onText || !*session.onText) return;
+    SessionOutput output;
+    output.onText = session.onText;
+    output.closed = session.closed;
+    output.id = session.id;
+    output.text = std::move(text);
+    output.finished = finished;
+    _sessionOutputs.push_back(std::move(output));
+}
 
-        for (char c : line) {
-            if (isalnum(c) || c == '.' || c == ',' || c == '!' || c == '?' || c == ':') {
-                hasAlpha = true;
-            } else if (!isspace(c) && !isalnum(c)) {
-                specialCount++;
-            }
+// Releases lock (held on entry) and runs the queued session callbacks. The
+// deliver mutex is taken before the context is released, so pieces reach each
+// listener in the order they were sampled even when two threads deliver.
+void LLMInference::_deliverSessionOutputs(std::unique_lock<std::mutex>& lock) {
+    if (_sessionOutputs.empty()) {
+        lock.unlock();
+        return;
+    }
+    std::vector<SessionOutput> outputs;
+    outputs.swap(_sessionOutputs);
+    std::unique_lock<std::mutex> deliver(_deliverMutex);
+    lock.unlock();
+
+    bool stopped = false;
+    for (SessionOutput& output : outputs) {
+        bool keepGoing = (*output.onText)(output.id, output.text, output.finished);
+        if (!keepGoing && !output.finished && !output.closed->exchange(true)) {
+            stopped = true;
         }
+    }
+    deliver.unlock();
+    if (stopped) {
+        // Reaped on the scheduler's next step
+        _sessionCv.notify_one();
+    }
+}
 
-        // Skip lines that are all special characters or template remnants
-        if (line.find("<|") != std::string::npos ||
-            line.find("|>") != std::string::npos ||
-            (specialCount > line.length() / 2 && !hasAlpha) ||
-            line.find("}}}}") != std::string::npos ||
-            line.find("{{{") != std::string::npos) {
-            isJunk = true;
+// Forked candidates share sequence 0's cells from position 0 up to nShared.
+// Before sequence 0 removes or shifts cells from pos on, end the forks whose
+// shared cells it would touch. Caller holds _ctxMutex.
+void LLMInference::_releaseForks(int pos) {
+    bool released = false;
+    for (auto& s : _sessions) {
+        if (s->nShared > pos && !s->closed->load()) {
+            s->closed->store(true);
+            released = true;
         }
+    }
+    if (released) {
+        LOGW("Ending forked candidates: sequence 0 is changing from position %d", pos);
+        _reapSessions();
+    }
+}
 
-        if (!isJunk && !line.empty()) {
-            if (!firstLine) cleaned += "\n";
-            cleaned += line;
-            firstLine = false;
+// Release finished and closed sessions: their cells, samplers and slots
+void LLMInference::_reapSessions() {
+    llama_memory_t mem = llama_get_memory(_ctx);
+    for (auto it = _sessions.begin(); it != _sessions.end(); ) {
+        BatchSession& s = **it;
+        if (!s.finished && !s.closed->load()) {
+            ++it;
+            continue;
+        }
+        _finishSession(s);
+        llama_memory_seq_rm(mem, s.id, -1, -1);
+        llama_sampler_free(s.sampler);
+        if (s.grammar) {
+            llama_sampler_free(s.grammar);
         }
+        it = _sessions.erase(it);
     }
+}
 
-    processed = cleaned;
+void LLMInference::_stopScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(_ctxMutex);
+        _schedulerStop = true;
+    }
+    _sessionCv.notify_one();
+    if (_schedulerThread.joinable()) {
+        _schedulerThread.join();
+    }
 
-    // Final cleanup - trim leading/trailing whitespace and newlines
-    while (!processed.empty() && (processed[0] == '\n' || processed[0] == '\r' || processed[0] == ' ')) {
-        processed.erase(0, 1);
+    std::unique_lock<std::mutex> lock(_ctxMutex);
+    for (auto& session : _sessions) {
+        session->closed->store(true);
     }
-    while (!processed.empty() && (processed.back() == '\n' || processed.back() == '\r' || processed.back() == ' ')) {
-        processed.pop_back();
+    if (_ctx) {
+        _reapSessions();
     }
+    _sessions.clear();
+    _schedulerStop = false;
+    _deliverSessionOutputs(lock);
+}
 
-    // If the response starts with a template-like pattern, try to extract just the content
-    if (processed.length() > 200) { // Only for long responses that might be malformed
-        // Look for the first meaningful content after cleanup
-        size_t firstRealContent = processed.find_first_not_of(" \t\n\r");
-        if (firstRealContent != std::string::npos) {
-            // If we find a pattern like "I am", "You are", "Here's", "Let me", etc., extract from there
-            std::vector<std::string> starters = {"I am", "You are", "Here's", "Here is", "Let me", "This is", "To help", "First,", "Second,", "Finally,"};
-            for (const auto& starter : starters) {
-                size_t startPos = processed.find(starter, firstRealContent);
-                if (startPos != std::string::npos && startPos < processed.length() / 3) {
-                    // Make sure it's at the start of a word/line
-                    if (startPos == 0 || processed[startPos-1] == '\n' || processed[startPos-1] == ' ') {
-                        processed = processed.substr(startPos);
-                        break;
-                    }
-                }
-            }
+// Drives batched sessions while the chat is idle; one shared decode per iteration
+void LLMInference::_schedulerLoop() {
+    std::unique_lock<std::mutex> lock(_ctxMutex);
+    while (true) {
+        _sessionCv.wait(lock, [this] { return _schedulerStop || (!_foregroundActive && !_sessions.empty()); });
+        if (_schedulerStop) break;
+
+        _reapSessions();
+        _sessionBatch.n_tokens = 0;
+        _fillSessionBatch();
+        if (_sessionBatch.n_tokens > 0) {
+            _backgroundStep.store(true);
+            float elapsedMs = 0;
+            int rc = _decode(_sessionBatch, elapsedMs);
+            _backgroundStep.store(false);
+            _finishSessionStep(rc);
         }
+
+        // Callbacks run unlocked, which also lets a waiting startCompletion
+        // take the context between steps
+        _deliverSessionOutputs(lock);
+        std::this_thread::yield();
+        lock.lock();
+    }
+}
+
+// Chat history larger than this marks a corrupt snapshot
+static constexpr uint64_t kMaxSnapshotHistoryBytes = 64ull * 1024 * 1024;
+
+bool LLMInference::saveSession(const char* path) {
+    if (!isReady()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(_ctxMutex);
+    if (_cacheTokens.empty()) {
+        return false;
     }
 
+    size_t stateSize = llama_state_seq_get_size(_ctx, 0);
+    std::vector<uint8_t> state(stateSize);
+    if (llama_state_seq_get_data(_ctx, state.data(), state.size(), 0) != stateSize) {
+        LOGE("Failed to read sequence state");
+        return false;
+    }
+
+    // The history goes along so the next turn renders the same prompt the tokens came from
+    std::vector<SessionStore::Message> messages;
+    for (const auto& msg : _messages) {
+        messages.emplace_back(msg.role, msg.content);
+    }
+    std::vector<uint8_t> history = SessionStore::encodeMessages(messages);
+
+    SessionStore::SnapshotHeader header;
+    header.modelFingerprint = _modelFingerprint;
+    header.contextLength = llama_n_ctx(_ctx);
+    header.kvTypeK = _kvTypeK;
+    header.kvTypeV = _kvTypeV;
+    header.tokenCount = (uint32_t)_cacheTokens.size();
+    header.stateSize = stateSize;
+    header.messageBytes = history.size();
+
+    // Write to a temp file and rename so a crash never leaves a torn snapshot
+    std::string tmpPath = std::string(path) + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if (!file) {
+        LOGE("Cannot open %s for writing", tmpPath.c_str());
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(_cacheTokens.data(), sizeof(llama_token), _cacheTokens.size(), file) == _cacheTokens.size() &&
+              fwrite(state.data(), 1, state.size(), file) == state.size() &&
+              fwrite(history.data(), 1, history.size(), file) == history.size();
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmpPath.c_str(), path) != 0) {
+        LOGE("Failed to write session snapshot %s", path);
+        remove(tmpPath.c_str());
+        return false;
+    }
+
+    LOGI("Session saved: %s (%u tokens, %zu messages, %zu bytes state)", path, header.tokenCount,
+         messages.size(), stateSize);
+    return true;
+}
+
+bool LLMInference::loadSession(const char* path) {
+    if (!isReady()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(_ctxMutex);
+
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+
+    SessionStore::SnapshotHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != SessionStore::kMagic ||
+        header.version != SessionStore::kVersion) {
+        LOGW("Rejecting session snapshot %s: bad header", path);
+        fclose(file);
+        return false;
+    }
+
+    if (header.modelFingerprint != _modelFingerprint ||
+        header.contextLength != llama_n_ctx(_ctx) ||
+        header.kvTypeK != (uint32_t)_kvTypeK || header.kvTypeV != (uint32_t)_kvTypeV ||
+        header.tokenCount == 0 || header.tokenCount > header.contextLength ||
+        header.messageBytes > kMaxSnapshotHistoryBytes) {
+        LOGW("Rejecting stale session snapshot %s", path);
+        fclose(file);
+        return false;
+    }
+
+    // The sizes must fit in the file before anything is allocated from them
+    struct stat st;
+    uint64_t payload = sizeof(header) + (uint64_t)header.tokenCount * sizeof(llama_token);
+    if (fstat(fileno(file), &st) != 0 || (uint64_t)st.st_size < payload ||
+        header.stateSize > (uint64_t)st.st_size - payload ||
+        header.messageBytes > (uint64_t)st.st_size - payload - header.stateSize) {
+        LOGW("Rejecting truncated session snapshot %s", path);
+        fclose(file);
+        return false;
+    }
+
+    std::vector<llama_token> tokens(header.tokenCount);
+    std::vector<uint8_t> state(header.stateSize);
+    std::vector<uint8_t> history(header.messageBytes);
+    std::vector<SessionStore::Message> messages;
+    bool ok = fread(tokens.data(), sizeof(llama_token), tokens.size(), file) == tokens.size() &&
+              fread(state.data(), 1, state.size(), file) == state.size() &&
+              fread(history.data(), 1, history.size(), file) == history.size() &&
+              SessionStore::decodeMessages(history, messages);
+    fclose(file);
+
+    if (!ok) {
+        LOGW("Rejecting truncated session snapshot %s", path);
+        return false;
+    }
+
+    _clearCache();
+    if (llama_state_seq_set_data(_ctx, state.data(), state.size(), 0) == 0) {
+        LOGE("Failed to restore sequence state from %s", path);
+        _clearCache();
+        return false;
+    }
+
+    _cacheTokens = std::move(tokens);
+    _nCtxUsed = (int)_cacheTokens.size();
+    _clearMessages();
+    for (const auto& message : messages) {
+        _addMessage(message.second.c_str(), message.first.c_str());
+    }
+    _prevRendered.clear();  // The history is re-rendered and matched against the restored tokens
+    SessionStore::touch(path);
+
+    LOGI("Session restored: %s (%d tokens, %zu messages)", path, _nCtxUsed, messages.size());
+    return true;
+}
+
+std::string LLMInference::postProcessResponse(const std::string& rawResponse) {
+    ResponseFilter filter;
+    std::string processed = filter.feed(rawResponse);
+    processed += filter.finish();
     return processed;
 }
 
 void LLMInference::stopCompletion() {
-    // Post-process the response to remove any artifacts (though we bypassed templates)
-    std::string cleanResponse = postProcessResponse(_response);
-    _response = cleanResponse;
-
-    if (_storeChats && !_response.empty()) {
-        addChatMessage(_response.c_str(), "assistant");
+    {
+        std::lock_guard<std::mutex> lock(_ctxMutex);
+        _foregroundActive = false;
+        _recordTurn(true);
+        // The turn consumed any cancel; one requested from here on applies to the next
+        _cancelRequested.store(false);
     }
+    _sessionCv.notify_one();
 
-    // No template to apply since we're using raw text
-    _prevLen = 0;
+    // _response was cleaned as it streamed; a stop before EOG drops any text
+    // the filter was still holding back, as it may be a partial artifact
+    _filter.reset();
 
     LOGI("Generation stopped. Response: %zu chars, %ld tokens",
          _response.length(), _responseNumTokens);
@@ -688,6 +1969,40 @@ float LLMInference::getResponseGenerationTime() const {
            (float)_responseNumTokens / (_responseGenerationTime / 1e6f) : 0.0f;
 }
 
+// Peak resident set size of this process (VmHWM), in kB
+static long readPeakRssKb() {
+    FILE* status = fopen("/proc/self/status", "r");
+    if (!status) return 0;
+
+    char line[256];
+    long peakKb = 0;
+    while (fgets(line, sizeof(line), status)) {
+        if (strncmp(line, "VmHWM:", 6) == 0) {
+            peakKb = strtol(line + 6, nullptr, 10);
+            break;
+        }
+    }
+    fclose(status);
+    return peakKb;
+}
+
+// Nearest-rank percentile; takes a copy since nth_element reorders
+static float percentile(std::vector<float> values, float p) {
+    if (values.empty()) return 0.0f;
+    size_t rank = std::min(values.size() - 1, (size_t)(p * (values.size() - 1) + 0.5f));
+    std::nth_element(values.begin(), values.begin() + rank, values.end());
+    return values[rank];
+}
+
+PerfMetrics LLMInference::getPerfMetrics() const {
+    PerfMetrics metrics = _perf;
+    metrics.decodeP50Ms = percentile(_decodeLatenciesMs, 0.50f);
+    metrics.decodeP95Ms = percentile(_decodeLatenciesMs, 0.95f);
+    metrics.decodeP99Ms = percentile(_decodeLatenciesMs, 0.99f);
+    metrics.peakRssKb = readPeakRssKb();
+    return metrics;
+}
+
 int LLMInference::getContextSizeUsed() const {
     return _nCtxUsed;
 }
@@ -699,26 +2014,123 @@ std::string LLMInference::getModelInfo() const {
     
     char info[512];
     snprintf(info, sizeof(info),
-        "Context: %d | Vocab: %d | Threads: %d",
+        "Context: %d | Vocab: %d | Threads: %d/%d | KV: %s/%s (%.0f MB) | Flash attn: %s",
         llama_n_ctx(_ctx),
         llama_vocab_n_tokens(llama_model_get_vocab(_model)),
-        _threads
+        _autoTune ? _threadTuner.threads() : _threads,
+        _batchThreads,
+        ggml_type_name(_kvTypeK),
+        ggml_type_name(_kvTypeV),
+        getKvCacheBytes() / (1024.0 * 1024.0),
+        _flashAttention ? "on" : "off"
     );
     return std::string(info);
 }
 
+uint64_t LLMInference::getModelSizeBytes() const {
+    return _model ? llama_model_size(_model) : 0;
+}
+
+uint64_t LLMInference::getKvCacheBytes() const {
+    if (!isReady()) return 0;
+    int nHead = std::max(1, llama_model_n_head(_model));
+    int nEmbdGqa = llama_model_n_embd(_model) / nHead * llama_model_n_head_kv(_model);
+    return estimateKvCacheBytes(llama_n_ctx(_ctx), llama_model_n_layer(_model),
+                                nEmbdGqa, nEmbdGqa, _kvTypeK, _kvTypeV);
+}
+
+uint64_t LLMInference::estimateKvCacheBytes(int nCtx, int nLayer, int nEmbdK, int nEmbdV,
+                                            ggml_type typeK, ggml_type typeV) {
+    uint64_t perCell = ggml_row_size(typeK, nEmbdK) + ggml_row_size(typeV, nEmbdV);
+    return perCell * (uint64_t)nLayer * (uint64_t)nCtx;
+}
+
+// Persistent worker pools, so decode steps don't spawn threads. Pinned to the
+// fastest cores on big.LITTLE CPUs: ggml applies the cpumask where it supports
+// affinity, and workers also inherit it from this thread while it is pinned.
+// The masks are kept for _decode, which pins the calling thread the same way.
+void LLMInference::_createThreadpools() {
+    const CpuTopology& cpu = CpuAffinity::system();
+    std::vector<int> saved = CpuAffinity::currentAffinity();
+    auto create = [&](int threads, std::vector<int>& cores) -> ggml_threadpool* {
+        cores = CpuAffinity::fastestCores(cpu, threads);
+        ggml_threadpool_params params = ggml_threadpool_params_default(threads);
+        for (int core : cores) {
+            if (core < GGML_MAX_N_THREADS) params.cpumask[core] = true;
+        }
+        bool pinned = CpuAffinity::pinCurrentThread(cores);
+        ggml_threadpool* pool = ggml_threadpool_new(&params);
+        if (pinned) {
+            CpuAffinity::pinCurrentThread(saved);
+        }
+        LOGI("Threadpool: %d threads%s", threads, cores.empty() ? "" : ", pinned to performance cores");
+        return pool;
+    };
+
+    _threadpool = create(_threads, _decodeCores);
+    _threadpoolBatch = _batchThreads != _threads ? create(_batchThreads, _batchCores) : nullptr;
+    if (!_threadpoolBatch) {
+        _batchCores = _decodeCores;
+    }
+    if (!_threadpool) {
+        LOGW("Threadpool creation failed, using llama.cpp's default threads");
+        _freeThreadpools();
+    }
+}
+
+// Only after every context using the pools is freed
+void LLMInference::_freeThreadpools() {
+    _decodeCores.clear();
+    _batchCores.clear();
+    if (_threadpoolBatch) {
+        ggml_threadpool_free(_threadpoolBatch);
+        _threadpoolBatch = nullptr;
+    }
+    if (_threadpool) {
+        ggml_threadpool_free(_threadpool);
+        _threadpool = nullptr;
+    }
+}
+
 void LLMInference::freeModel() {
-    clearMessages();
+    // Stop and wait for any background generation before tearing down
+    requestCancel();
+    joinBackground();
+    _stopScheduler();
+    _prefetcher.stop();
+
+    _clearMessages();
+    _promptLookup = false;
+    _autoTune = false;
+    freeDraftModel();
     
     if (_sampler) {
         llama_sampler_free(_sampler);
         _sampler = nullptr;
     }
+    if (_grammar) {
+        llama_sampler_free(_grammar);
+        _grammar = nullptr;
+    }
+    _grammarCache.clear();
+    _samplerParams.grammar.clear();
+    _samplerParams.jsonSchema = false;
+    
+    if (_sessionBatch.token) {
+        llama_batch_free(_sessionBatch);
+        _sessionBatch = {};
+    }
     
     if (_ctx) {
         llama_free(_ctx);
         _ctx = nullptr;
     }
+    _freeThreadpools();
+    _cacheTokens.clear();
+    _nCtxUsed = 0;
+    _prefixText.clear();
+    _prefixTokens.clear();
+    _prefixState.clear();
     
     if (_model) {
         llama_model_free(_model);
@@ -1,19 +1,78 @@
 #pragma once
 #include "llama.h"
 #include "ggml.h"
+#include "Sampling.h"
+#include "ResponseFilter.h"
+#include "Utf8.h"
+#include "GgufReader.h"
+#include "ThreadTuner.h"
+#include "WeightPrefetcher.h"
 #include <string>
 #include <vector>
 #include <cstring>
 #include <utility>
 #include <sstream>
 #include <cctype>
+#include <chrono>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 
-// Model metadata structure
-struct ModelMetadata {
-    int contextSize = 4096;
-    std::string chatTemplate = "";
-    std::string architecture = "";
-    bool valid = false;
+// Per-phase timings; load/page-in describe the model, the rest the last response
+struct PerfMetrics {
+    float loadMs = 0;
+    float pageInMs = 0;         // First decode after load (faults weights in from mmap)
+    float warmupMs = 0;         // Warm-up decode inside loadModel, 0 if it did not run
+    int prefillTokens = 0;
+    float prefillMs = 0;
+    float ttftMs = 0;           // startCompletion to first generated token
+    int decodeTokens = 0;
+    float decodeMs = 0;
+    float decodeP50Ms = 0;      // Per-token decode latency percentiles
+    float decodeP95Ms = 0;
+    float decodeP99Ms = 0;
+    float sampleMs = 0;
+    float detokenizeMs = 0;
+    long peakRssKb = 0;
+};
+
+// Optional loadModel stage that moves first-use costs (page faults, graph
+// setup) out of the first reply
+struct WarmupOptions {
+    bool enabled = false;
+    bool prefetch = true;        // Read the weight file into the page cache in the background
+    uint64_t mlockMaxBytes = 0;  // Lock weights in RAM when they are at most this size (0: never)
+};
+
+// KV cache element types accepted by loadModel (values match the Kotlin enum ordinal)
+enum class KvCacheType {
+    F16 = 0,
+    Q8_0 = 1,
+    Q4_0 = 2,
+    Auto = 3    // Chosen by MemoryPlanner at load time
+};
+
+// Prefill progress: tokens processed so far and total; return false to cancel
+using PrefillCallback = std::function<bool(int processed, int total)>;
+
+// Receives generated text in batches; return false to stop generation
+using TextCallback = std::function<bool(const std::string& text)>;
+
+// Output of a batched session: each piece as it is sampled, then once with
+// finished=true and an empty piece. Return false to stop the session (it may
+// still sample one more step). Runs on whichever thread drove the shared decode
+// step, after it released the context, and must not call back into the engine.
+using SessionCallback = std::function<bool(int sessionId, const std::string& piece, bool finished)>;
+
+// How generate() groups tokens before handing text to the caller
+struct GenerationOptions {
+    int maxTokens = 512;
+    int flushTokens = 8;        // Deliver after this many tokens...
+    int flushIntervalMs = 50;   // ...or once this much time has passed
 };
 
 class LLMInference {
@@ -28,63 +87,280 @@ private:
     std::vector<llama_chat_message> _messages;
     std::vector<char> _formattedMessages;
     std::vector<llama_token> _promptTokens;
-    int _prevLen = 0;
+    std::string _prevRendered;            // Rendered history in sequence 0, through the last reply; empty re-renders it all
+    bool _turnOpen = false;               // Last message is the current request's user turn
     const char* _chatTemplate = nullptr;
     const char* _modelChatTemplate = nullptr; // Store original model template
     
     // Response tracking
-    std::string _response;
-    std::string _utf8Cache;
+    std::string _response;                // Filtered text streamed so far
+    Utf8::Assembler _utf8;                // Carries split multibyte characters between tokens
+    ResponseFilter _filter;
+    StopMatcher _stopMatcher;
+    bool _eogPending = false;             // Filter tail was flushed; next step reports EOG
     bool _storeChats = true;
     
     // Metrics
     int64_t _responseGenerationTime = 0;
     long _responseNumTokens = 0;
     int _nCtxUsed = 0;
+    int _nReusedTokens = 0;   // Prompt tokens served from the KV cache
+    int _nDecodedTokens = 0;  // Prompt tokens actually run through llama_decode
+    
+    // Tokens currently resident in the KV cache for sequence 0
+    std::vector<llama_token> _cacheTokens;
+    
+    // Model identity (used to validate session snapshots)
+    std::string _modelPath;
+    uint64_t _modelFingerprint = 0;
+    
+    // Per-phase instrumentation
+    PerfMetrics _perf;
+    std::vector<float> _decodeLatenciesMs;
+    bool _pagedIn = false;
+    WarmupOptions _warmup;
+    WeightPrefetcher _prefetcher;
+    std::chrono::steady_clock::time_point _completionStart;
     
     // Settings
-    int _threads = 4;
+    int _threads = 4;              // Decode (single-token steps)
+    int _batchThreads = 4;         // Prefill and batched steps
+    ggml_threadpool* _threadpool = nullptr;       // Decode workers, on the fastest cores
+    ggml_threadpool* _threadpoolBatch = nullptr;  // Prefill workers, on every performance core
+    std::vector<int> _decodeCores;  // Pool cpumasks; the thread calling llama_decode joins them
+    std::vector<int> _batchCores;
+    bool _autoTune = false;        // Decode thread count follows _threadTuner
+    ThreadTuner _threadTuner;
+    std::string _tuneStatePath;    // Saved tuning results ("" keeps them in memory only)
+    uint64_t _tuneKey = 0;         // Model and CPU layout the results belong to
     int _contextLength = 4096;
-    float _temperature = 0.8f;
+    SamplerParams _samplerParams;  // Chain currently built into _sampler
+    llama_sampler* _grammar = nullptr;           // Constrains the chat's sampling when set
+    Sampling::GrammarCache _grammarCache;
+    std::vector<llama_token_data> _candidates;   // Scratch for constrained sampling
+    ggml_type _kvTypeK = GGML_TYPE_F16;
+    ggml_type _kvTypeV = GGML_TYPE_F16;
+    bool _flashAttention = false;
+    int _prefillChunk = 512;       // Tokens per llama_decode call during prefill
+    bool _prefillCancelled = false;
+    std::atomic<bool> _cancelRequested{false};  // Set from any thread via requestCancel()
+    std::thread _worker;                        // Runs background generation
+    
+    // Speculative decoding with an optional small draft model sharing the vocabulary
+    llama_model* _draftModel = nullptr;
+    llama_context* _draftCtx = nullptr;
+    std::vector<llama_token> _draftCacheTokens;  // Tokens resident in the draft KV cache
+    llama_batch _specBatch = {};                 // Verification batch for the main model
+    int _specBatchCapacity = 0;
+    int _nDraft = 4;
+    bool _promptLookup = false;                  // Draft from n-gram matches in the history instead
+    int _lookupNgramMax = 3;
+    std::deque<llama_token> _specQueue;          // Accepted tokens already decoded, not yet emitted
+    llama_token _carryToken = 0;                 // Sampled from the main model but not yet decoded
+    bool _hasCarry = false;
+    long _specDrafted = 0;                       // This response's drafts; reset per completion
+    long _specAccepted = 0;
+    std::chrono::steady_clock::time_point _generationStart;
+    std::chrono::steady_clock::time_point _lastTokenTime;
+    
+    // Context overflow policy: shift instead of failing when n_ctx is reached
+    bool _contextShift = true;
+    int _shiftKeep = -1;     // Leading tokens never discarded (-1: cached system prefix)
+    int _shiftDiscard = 0;   // Tokens dropped per shift (0: half of the rest)
+    
+    // Continuous batching: extra conversations on their own sequence IDs in the
+    // same context. Their decode steps ride along with the foreground chat's
+    // (sequence 0) or, while it is idle, run on a scheduler thread; either way
+    // every active conversation advances in a single llama_decode per step.
+    static constexpr int kMaxSequences = 8;
+    struct BatchSession {
+        int id = 0;                       // Also its llama sequence ID
+        llama_sampler* sampler = nullptr;
+        llama_sampler* grammar = nullptr;  // Own clone of the request's grammar, if any
+        std::vector<llama_token> prompt;
+        size_t prefilled = 0;             // Prompt tokens already in the KV cache
+        int nPast = 0;                    // Cells held by this sequence
+        int nShared = 0;                  // Leading cells shared with sequence 0 (forks)
+        llama_token next = 0;             // Sampled but not yet decoded
+        bool hasNext = false;
+        int maxTokens = 0;
+        int generated = 0;
+        int stepPrompt = 0;               // Prompt tokens in the current batch
+        bool stepNext = false;            // Whether next is in the current batch
+        int batchIdx = -1;                // Batch row to sample from, -1 if none
+        std::shared_ptr<SessionCallback> onText;
+        Utf8::Assembler utf8;
+        ResponseFilter filter;
+        // Shared with queued output so a callback returning false can close it unlocked
+        std::shared_ptr<std::atomic<bool>> closed = std::make_shared<std::atomic<bool>>(false);
+        bool finished = false;
+    };
+    // Session text is queued under _ctxMutex and handed to the callbacks after
+    // it is released, so a slow listener never stalls the shared decode
+    struct SessionOutput {
+        std::shared_ptr<SessionCallback> onText;
+        std::shared_ptr<std::atomic<bool>> closed;
+        int id = 0;
+        std::string text;
+        bool finished = false;
+    };
+    std::vector<std::unique_ptr<BatchSession>> _sessions;
+    std::vector<SessionOutput> _sessionOutputs;
+    std::mutex _deliverMutex;             // Keeps each session's output in order across threads
+    llama_batch _sessionBatch = {};
+    std::mutex _ctxMutex;                 // Serializes context use with the scheduler thread
+    std::condition_variable _sessionCv;
+    std::thread _schedulerThread;
+    bool _schedulerStop = false;
+    bool _foregroundActive = false;       // startCompletion..stopCompletion; sessions ride its steps
+    std::atomic<bool> _backgroundStep{false};  // Scheduler decode in flight; ignores foreground cancel
+    int _mainLogitsIdx = -1;              // Batch row holding sequence 0's logits
     
-    // UTF-8 validation helper
-    bool _isValidUtf8(const char* str);
+    // KV cache helpers
+    void _clearCache();
+    std::vector<llama_token> _tokenize(const std::string& text, bool addBos = false, bool parseSpecial = false) const;
+    bool _decodeChunked(const llama_token* tokens, int count, const PrefillCallback& onProgress);
+    bool _decodeToken(llama_token token);
+    int _decode(llama_batch batch, float& elapsedMs);
+    llama_token _sample(int idx);
+    std::string _completionStep();
+    void _trimCacheToTokens();
+    static bool _abortCallback(void* data);
+    bool _syncDraft(llama_token next);
+    std::vector<llama_token> _draftWithModel(llama_token first);
+    std::vector<llama_token> _draftWithLookup(llama_token first) const;
+    void _ensureSpecBatch();
+    enum class SpecStep { Skipped, Queued, Failed };
+    SpecStep _speculativeStep();
+    void _dropQueuedTokens();
+    void _shiftWindow(int& nKeep, int& nBlock) const;
+    bool _shiftContext();
+    void _truncatePrompt(int limit);
+    bool _startCompletion(const char* query, const PrefillCallback& onProgress, const SamplerParams* sampling,
+                          const std::vector<std::string>& stop);
+    std::string _finishResponse(const std::string& text);
+    int _formatMessages(bool addAssistant);
+    void _addMessage(const char* message, const char* role);
+    void _clearMessages();
+    void _popMessage();
+    void _recordTurn(bool keepReply);
+    bool _applySamplerParams(const SamplerParams* sampling);
+    BatchSession* _newSession(int maxTokens, SessionCallback onText);
+    bool _hasRunnableSessions() const;
+    int _sessionCells() const;
+    bool _decodeTokenWithSessions(llama_token token);
+    void _fillSessionBatch();
+    void _finishSessionStep(int rc);
+    void _sampleSession(BatchSession& session);
+    void _finishSession(BatchSession& session);
+    void _queueSessionOutput(BatchSession& session, std::string text, bool finished);
+    void _deliverSessionOutputs(std::unique_lock<std::mutex>& lock);
+    void _reapSessions();
+    void _releaseForks(int pos);
+    void _stopScheduler();
+    void _schedulerLoop();
+    void _createThreadpools();
+    void _freeThreadpools();
+    void _tuneThreads(float decodeMs);
+    void _warmupDecode();
+    
+    // System prompt prefix cache (KV snapshot of the shared conversation head)
+    std::string _systemPrompt = "You are a helpful assistant.";
+    std::string _prefixText;
+    std::vector<llama_token> _prefixTokens;
+    std::vector<uint8_t> _prefixState;
+    std::string _systemPrefixText() const;
+    bool _primePrefixCache(const std::string& text);
+    void _applyPrefixCache();
 
 public:
     LLMInference() = default;
     ~LLMInference();
     
     // Static metadata reading (before loading model)
-    static ModelMetadata getModelMetadata(const char* modelPath);
-    static ModelMetadata getModelMetadataFallback(const char* modelPath);
+    static ModelMetadata getModelMetadata(const char* modelPath);  // Header only, cached
     
-    // Model lifecycle
+    // Model lifecycle. threads <= 0 picks separate prefill and decode counts
+    // for this CPU; either way workers stay off efficiency cores when possible.
     bool loadModel(const char* modelPath, int threads, int contextLength,
-                   float temperature, bool storeChats);
+                   float temperature, bool storeChats,
+                   KvCacheType kvCacheType = KvCacheType::F16, bool flashAttention = false);
+    void setWarmup(const WarmupOptions& options) { _warmup = options; }  // Applies to the next loadModel
     void startFreshConversation(); // Clears context without losing model
     void freeModel();
+    bool loadDraftModel(const char* modelPath, int nDraft);
+    void freeDraftModel();
+    void setPromptLookup(bool enabled, int ngramMax, int nDraft);
     bool isReady() const { return _model != nullptr && _ctx != nullptr; }
     
-    // Chat management
+    // Chat management; these take the context lock
     void addChatMessage(const char* message, const char* role);
-    void addSystemPrompt(const char* prompt) { addChatMessage(prompt, "system"); }
+    void addSystemPrompt(const char* prompt);
+    void setSystemPrompt(const char* prompt);
     void addUserMessage(const char* message) { addChatMessage(message, "user"); }
     void addAssistantMessage(const char* message) { addChatMessage(message, "assistant"); }
     void clearMessages();
     
     // Generation lifecycle
-    bool startCompletion(const char* query);
+    // sampling overrides the sampler chain from this request on; nullptr keeps the current one.
+    // Generation ends at the first of the stop strings, which is left out of the response.
+    bool startCompletion(const char* query, const PrefillCallback& onProgress = nullptr,
+                         const SamplerParams* sampling = nullptr, const std::vector<std::string>& stop = {});
     std::string completionLoop();  // Returns token piece or "[EOG]"
     void stopCompletion();
+    int generate(const GenerationOptions& options, const TextCallback& onText);  // Token count, -1 on error
+    void runInBackground(std::function<void()> task);
+    void joinBackground();
+    bool wasPrefillCancelled() const { return _prefillCancelled; }
+    // Thread-safe. Cleared when a turn ends, so a cancel issued before the next
+    // turn's prefill starts still stops that turn.
+    void requestCancel() { _cancelRequested.store(true); }
+    void setPrefillChunkSize(int tokens);  // Capped at the loaded context's n_batch, with a warning
+    void setContextShift(bool enabled, int keepTokens, int discardTokens);
+    // Tune the decode thread count from measured token latency while generating.
+    // statePath (optional) keeps the result per device and model for later loads.
+    void setThreadAutoTune(bool enabled, const char* statePath);
 
-    // Response post-processing
+    // Batched sessions: background conversations decoded alongside the chat.
+    // openSession returns the session ID, or -1 when no sequence is free. Sessions
+    // sample with the current sampler settings, grammar included.
+    int openSession(const char* prompt, int maxTokens, SessionCallback onText);
+    void closeSession(int sessionId);  // Any thread, but not from a SessionCallback
+    // Parallel sampling: prefill once, then decode n candidate responses as forked
+    // sessions in shared batches. Returns the candidates' session IDs (empty on failure,
+    // or while a chat turn is in progress). The candidates end early if the chat's
+    // next turn rewrites the prompt cells they share.
+    std::vector<int> startCandidates(const char* query, int n, int maxTokens,
+                                     const PrefillCallback& onProgress, const SessionCallback& onText,
+                                     const SamplerParams* sampling = nullptr);
+    int getActiveSessionCount();
+    
+    // Session snapshots: tokens and KV state of sequence 0 plus the chat history.
+    // A restore replaces the history, so callers need not replay it.
+    bool saveSession(const char* path);
+    bool loadSession(const char* path);
+    
+    // Response post-processing (one-shot form of the streaming filter)
     std::string postProcessResponse(const std::string& rawResponse);
     
     // Metrics
     float getResponseGenerationTime() const;
+    PerfMetrics getPerfMetrics() const;
     int getContextSizeUsed() const;
+    int getPromptTokensReused() const { return _nReusedTokens; }
+    int getPromptTokensDecoded() const { return _nDecodedTokens; }
     int getResponseNumTokens() const { return _responseNumTokens; }
+    float getDraftAcceptanceRate() const;
+    float getEffectiveTokensPerSecond() const;
+    long getDraftedTokens() const { return _specDrafted; }
+    long getAcceptedDraftTokens() const { return _specAccepted; }
     
     // Info
     std::string getModelInfo() const;
+    uint64_t getModelSizeBytes() const;
+    uint64_t getKvCacheBytes() const;
+    
+    // Bytes of K+V for nCtx cells; nEmbdK/nEmbdV are per-layer widths (head_dim * n_head_kv)
+    static uint64_t estimateKvCacheBytes(int nCtx, int nLayer, int nEmbdK, int nEmbdV,
+                                         ggml_type typeK, ggml_type typeV);
 };
@@ -0,0 +1,58 @@
+#include "Logging.h"
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <string>
+
+#ifdef __ANDROID__
+#include <android/log.h>
+#endif
+
+namespace Logging {
+
+static void defaultSink(Level level, const char* tag, const char* message) {
+#ifdef __ANDROID__
+    int priority = level == Level::Error ? ANDROID_LOG_ERROR
+                 : level == Level::Warn ? ANDROID_LOG_WARN
+                 : ANDROID_LOG_INFO;
+    __android_log_write(priority, tag, message);
+#else
+    const char* prefix = level == Level::Error ? "E" : level == Level::Warn ? "W" : "I";
+    fprintf(stderr, "%s/%s: %s\n", prefix, tag, message);
+#endif
+}
+
+static std::atomic<Sink> activeSink{defaultSink};
+
+void setSink(Sink sink) {
+    activeSink.store(sink ? sink : defaultSink);
+}
+
+void write(Level level, const char* tag, const char* format, ...) {
+    char buffer[512];
+    va_list args;
+    va_start(args, format);
+    va_list retry;
+    va_copy(retry, args);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    if (length < 0) {
+        va_end(retry);
+        return;
+    }
+
+    // Rare long messages (e.g. prompts) fall back to a heap buffer
+    if ((size_t)length >= sizeof(buffer)) {
+        std::string message(length, '\0');
+        vsnprintf(&message[0], message.size() + 1, format, retry);
+        va_end(retry);
+        activeSink.load()(level, tag, message.c_str());
+        return;
+    }
+
+    va_end(retry);
+    activeSink.load()(level, tag, buffer);
+}
+
+} // namespace Logging
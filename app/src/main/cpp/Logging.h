@@ -0,0 +1,21 @@
+#pragma once
+
+// Pluggable log sink so the engine builds on hosts without the Android NDK.
+// Defaults to logcat on Android and stderr elsewhere.
+namespace Logging {
+
+enum class Level {
+    Info,
+    Warn,
+    Error
+};
+
+using Sink = void (*)(Level level, const char* tag, const char* message);
+
+// Replace the active sink; nullptr restores the platform default
+void setSink(Sink sink);
+
+void write(Level level, const char* tag, const char* format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+} // namespace Logging
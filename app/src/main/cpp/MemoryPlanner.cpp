@@ -0,0 +1,126 @@
+#include "MemoryPlanner.h"
+#include "CpuAffinity.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+constexpr uint64_t kMiB = 1024 * 1024;
+constexpr uint64_t kOverheadBytes = 96 * kMiB;
+constexpr int kMinContext = 512;
+
+ggml_type ggmlType(KvCacheType type) {
+    switch (type) {
+        case KvCacheType::Q8_0: return GGML_TYPE_Q8_0;
+        case KvCacheType::Q4_0: return GGML_TYPE_Q4_0;
+        default:                return GGML_TYPE_F16;
+    }
+}
+
+// Activations for one batch (residual, attention and FFN intermediates) plus
+// the attention score matrix, which flash attention never materializes
+uint64_t computeBytes(const ModelMetadata& m, int contextLength, int batchSize, bool flashAttention) {
+    uint64_t batch = (uint64_t)std::min(batchSize, contextLength);
+    uint64_t ff = m.feedForwardLength > 0 ? m.feedForwardLength : 4ull * m.embeddingLength;
+    uint64_t bytes = batch * (4ull * m.embeddingLength + 3 * ff) * sizeof(float);
+    if (!flashAttention) {
+        bytes += batch * (uint64_t)contextLength * std::max(1, m.headCount) * sizeof(float);
+    }
+    bytes += (uint64_t)m.vocabSize * sizeof(float);  // Logits of the last position
+    return bytes;
+}
+
+}  // namespace
+
+namespace MemoryPlanner {
+
+uint64_t availableBytes() {
+    FILE* file = fopen("/proc/meminfo", "r");
+    if (!file) return 0;
+
+    char line[128];
+    uint64_t kb = 0;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "MemAvailable: %llu kB", (unsigned long long*)&kb) == 1) break;
+    }
+    fclose(file);
+    return kb * 1024;
+}
+
+uint64_t defaultBudgetBytes() {
+    return availableBytes() / 4 * 3;
+}
+
+int recommendedThreads() {
+    return CpuAffinity::system().decodeThreads;
+}
+
+MemoryPlan evaluate(const ModelMetadata& metadata, int contextLength, KvCacheType kvCacheType,
+                    bool flashAttention, int batchSize, uint64_t budgetBytes) {
+    MemoryPlan plan;
+    plan.contextLength = contextLength;
+    plan.kvCacheType = kvCacheType;
+    plan.flashAttention = flashAttention;
+    plan.threads = recommendedThreads();
+    plan.budgetBytes = budgetBytes;
+
+    int nHeadKv = std::max(1, metadata.headCountKv);
+    int nEmbdK = metadata.keyLength * nHeadKv;
+    int nEmbdV = metadata.valueLength * nHeadKv;
+    ggml_type typeK = ggmlType(kvCacheType);
+    ggml_type typeV = plan.flashAttention ? typeK : GGML_TYPE_F16;
+
+    plan.weightsBytes = (uint64_t)metadata.tensorBytes;
+    plan.kvBytes = LLMInference::estimateKvCacheBytes(contextLength, metadata.layerCount,
+                                                      nEmbdK, nEmbdV, typeK, typeV);
+    plan.computeBytes = computeBytes(metadata, contextLength, batchSize, plan.flashAttention);
+    plan.overheadBytes = kOverheadBytes;
+    plan.totalBytes = plan.weightsBytes + plan.kvBytes + plan.computeBytes + plan.overheadBytes;
+    plan.fits = plan.totalBytes <= budgetBytes;
+    return plan;
+}
+
+MemoryPlan plan(const ModelMetadata& metadata, uint64_t budgetBytes, int contextLength,
+                KvCacheType kvCacheType, bool flashAttention, int batchSize) {
+    if (budgetBytes == 0) {
+        budgetBytes = defaultBudgetBytes();
+    }
+    if (budgetBytes == 0) {
+        budgetBytes = UINT64_MAX;  // Free memory unknown: only the context cap applies
+    }
+
+    // Candidate contexts, largest first
+    std::vector<int> contexts;
+    if (contextLength > 0) {
+        contexts.push_back(contextLength);
+    } else {
+        int top = std::min(metadata.valid ? metadata.contextSize : 2048, kMaxAutoContext);
+        for (int ctx = std::max(top, kMinContext); ctx >= kMinContext; ctx /= 2) {
+            contexts.push_back(ctx);
+        }
+    }
+
+    // A 4-bit KV cache costs quality, so it is only used once 8-bit no longer fits
+    std::vector<std::vector<KvCacheType>> passes;
+    if (kvCacheType == KvCacheType::Auto) {
+        passes = {{KvCacheType::F16, KvCacheType::Q8_0}, {KvCacheType::Q4_0}};
+    } else {
+        passes = {{kvCacheType}};
+    }
+
+    MemoryPlan last;
+    for (const auto& types : passes) {
+        for (int ctx : contexts) {
+            for (KvCacheType type : types) {
+                last = evaluate(metadata, ctx, type, flashAttention, batchSize, budgetBytes);
+                if (last.fits) return last;
+            }
+        }
+    }
+    return last;
+}
+
+}  // namespace MemoryPlanner
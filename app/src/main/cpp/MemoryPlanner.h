@@ -0,0 +1,47 @@
+#pragma once
+#include "GgufReader.h"
+#include "LLMInference.h"
+#include <cstdint>
+
+// Estimated footprint of one load configuration
+struct MemoryPlan {
+    bool fits = false;
+    int contextLength = 0;
+    KvCacheType kvCacheType = KvCacheType::F16;
+    bool flashAttention = false;    // Quantizes V too and drops the attention score matrix
+    int threads = 0;
+    uint64_t weightsBytes = 0;
+    uint64_t kvBytes = 0;
+    uint64_t computeBytes = 0;      // Graph scratch for one prefill batch
+    uint64_t overheadBytes = 0;     // Runtime, tokenizer and app baseline
+    uint64_t totalBytes = 0;
+    uint64_t budgetBytes = 0;
+};
+
+// Picks context length, KV cache type and threads from GGUF header data and
+// the device's free memory, before anything is loaded. Estimates err high.
+namespace MemoryPlanner {
+
+constexpr int kMaxAutoContext = 8192;   // Longer prompts are too slow to prefill on phones
+
+// MemAvailable from /proc/meminfo (0 if unknown)
+uint64_t availableBytes();
+
+// Share of available memory a model may take, leaving room for the rest of the app
+uint64_t defaultBudgetBytes();
+
+// Decode threads for this CPU (see CpuAffinity)
+int recommendedThreads();
+
+MemoryPlan evaluate(const ModelMetadata& metadata, int contextLength, KvCacheType kvCacheType,
+                    bool flashAttention, int batchSize, uint64_t budgetBytes);
+
+// contextLength <= 0 searches down from the model's training context (capped at
+// kMaxAutoContext); KvCacheType::Auto tries F16 and Q8_0 before Q4_0.
+// budgetBytes 0 uses defaultBudgetBytes(). If nothing fits, the smallest
+// candidate is returned with fits = false. flashAttention is the setting the
+// context will be created with; without it only K is quantized.
+MemoryPlan plan(const ModelMetadata& metadata, uint64_t budgetBytes, int contextLength,
+                KvCacheType kvCacheType, bool flashAttention, int batchSize = 512);
+
+}  // namespace MemoryPlanner
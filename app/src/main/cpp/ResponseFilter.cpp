@@ -0,0 +1,310 @@
+#include "ResponseFilter.h"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+// What a matched pattern does: drop it, or drop everything up to a closing marker
+struct Pattern {
+    const char* text;
+    const char* skipUntil;
+};
+
+const Pattern kPatterns[] = {
+    // Chat-template headers and metadata lines, removed as whole blocks
+    {"<|start_header_id|>", "<|end_header_id|>"},
+    {"Little \xE2\x80\xA2 snow \xE2\x80\xA2, [", "]"},
+    // Stray template tokens
+    {"<|end_header_id|>", nullptr},
+    {"<|eot_id|>", nullptr},
+    {"`python", nullptr},
+    {"`", nullptr},
+    // Malformed brackets and separators
+    {"_\"}}", nullptr},
+    {"}}}}", nullptr},
+    {"{{{{", nullptr},
+    {"|>>_", nullptr},
+    {"_|\">", nullptr},
+    {"|\">", nullptr},
+    {"|>", nullptr},
+    {"|\"\"/>", nullptr},
+    {"|\">|\">", nullptr},
+    {"\"}}`", nullptr},
+    {"`\"", nullptr},
+    {"_\"}}}}", nullptr},
+    {"}}}}`", nullptr},
+    {"\"}}}}", nullptr},
+};
+
+// Give up on an unterminated block after this many bytes and keep its body
+constexpr size_t kMaxSkip = 256;
+
+struct Trie {
+    struct Node {
+        std::array<int, 256> next;
+        int pattern = -1;
+        Node() { next.fill(-1); }
+    };
+    std::vector<Node> nodes;
+
+    Trie() {
+        nodes.emplace_back();
+        for (int p = 0; p < (int)(sizeof(kPatterns) / sizeof(kPatterns[0])); ++p) {
+            int node = 0;
+            for (const char* c = kPatterns[p].text; *c; ++c) {
+                unsigned char byte = (unsigned char)*c;
+                if (nodes[node].next[byte] < 0) {
+                    nodes[node].next[byte] = (int)nodes.size();
+                    nodes.emplace_back();
+                }
+                node = nodes[node].next[byte];
+            }
+            nodes[node].pattern = p;
+        }
+    }
+
+    bool hasChildren(int node) const {
+        for (int child : nodes[node].next) {
+            if (child >= 0) return true;
+        }
+        return false;
+    }
+};
+
+const Trie& trie() {
+    static const Trie instance;
+    return instance;
+}
+
+// Bytes of multibyte UTF-8 characters count too, so lines of only CJK text or
+// emoji are kept
+bool isCountedAsText(char c) {
+    unsigned char byte = (unsigned char)c;
+    return byte >= 0x80 || isalnum(byte) || c == '.' || c == ',' || c == '!' || c == '?' || c == ':';
+}
+
+} // namespace
+
+void ResponseFilter::reset(bool enabled) {
+    *this = ResponseFilter();
+    _enabled = enabled;
+}
+
+std::string ResponseFilter::feed(const std::string& piece) {
+    if (!_enabled) return piece;
+
+    std::string out;
+    _out = &out;
+    _pending += piece;
+    _process(false);
+    _out = nullptr;
+    return out;
+}
+
+std::string ResponseFilter::finish() {
+    if (!_enabled) return "";
+
+    std::string out;
+    _out = &out;
+    _process(true);
+    for (; _braceRun > 0 && _braceRun < 4; --_braceRun) {
+        _lineChar('{');
+    }
+    _braceRun = 0;
+    _endLine();
+    _held.clear();  // Trailing whitespace is trimmed
+    _out = nullptr;
+    return out;
+}
+
+// Longest pattern match at each position; stops where more input could change the answer
+void ResponseFilter::_process(bool final) {
+    const Trie& t = trie();
+    size_t pos = 0;
+
+    while (pos < _pending.size() || (_skipUntil && final)) {
+        if (_skipUntil) {
+            size_t end = _pending.find(_skipUntil, pos);
+            if (end != std::string::npos) {
+                pos = end + strlen(_skipUntil);
+                _skipUntil = nullptr;
+                _dropNewlines = true;
+                continue;
+            }
+            if (!final && _pending.size() - _skipFrom <= kMaxSkip) {
+                break;  // Keep waiting for the closing marker
+            }
+            // Unterminated: only the opening token is removed
+            pos = _skipFrom;
+            _skipUntil = nullptr;
+            continue;
+        }
+
+        int node = 0;
+        int matched = -1;
+        size_t matchedLen = 0;
+        size_t i = pos;
+        for (; i < _pending.size(); ++i) {
+            node = t.nodes[node].next[(unsigned char)_pending[i]];
+            if (node < 0) break;
+            if (t.nodes[node].pattern >= 0) {
+                matched = t.nodes[node].pattern;
+                matchedLen = i + 1 - pos;
+            }
+        }
+        if (i == _pending.size() && node >= 0 && !final && t.hasChildren(node)) {
+            break;  // A longer pattern could still match once more text arrives
+        }
+
+        if (matched >= 0) {
+            pos += matchedLen;
+            if (kPatterns[matched].skipUntil) {
+                _skipUntil = kPatterns[matched].skipUntil;
+                _skipFrom = pos;
+            }
+            continue;
+        }
+
+        char c = _pending[pos++];
+        if (_dropNewlines && (c == '\n' || c == '\r')) continue;
+        _dropNewlines = false;
+        _braces(c);
+    }
+
+    size_t keepFrom = _skipUntil ? std::min(pos, _skipFrom) : pos;
+    if (_skipUntil) _skipFrom -= keepFrom;
+    _pending.erase(0, keepFrom);
+}
+
+// Runs of four or more '{' are dropped; shorter runs pass through
+void ResponseFilter::_braces(char c) {
+    if (c == '{') {
+        _braceRun++;
+        return;
+    }
+    for (; _braceRun > 0 && _braceRun < 4; --_braceRun) {
+        _lineChar('{');
+    }
+    _braceRun = 0;
+    _lineChar(c);
+}
+
+// A line is shown as soon as it has real text; lines of only symbols are
+// held until they end and dropped if mostly special characters
+void ResponseFilter::_lineChar(char c) {
+    if (c == '\n') {
+        _endLine();
+        return;
+    }
+    if (_lineDropped) return;
+
+    _line += c;
+    if (isCountedAsText(c)) {
+        _lineHasText = true;
+    } else if (!isspace((unsigned char)c)) {
+        _lineSpecial++;
+    }
+
+    // Template remnants make the line junk (or, once shown, end it here)
+    size_t n = _line.size();
+    bool marker = (n >= 2 && _line.compare(n - 2, 2, "<|") == 0) ||
+                  (n >= 3 && _line.compare(n - 3, 3, "{{{") == 0);
+    if (marker) {
+        _lineDropped = true;
+        _line.clear();
+        return;
+    }
+
+    if (_lineKept) {
+        // Hold a possible marker start until the next byte decides it
+        if (c == '<' || c == '{') return;
+        for (char held : _line) _emit(held);
+        _line.clear();
+    } else if (_lineHasText) {
+        _keepLine();
+    }
+}
+
+void ResponseFilter::_endLine() {
+    if (!_lineDropped && !_line.empty()) {
+        bool junk = !_lineHasText && _lineSpecial > (int)_line.size() / 2;
+        if (!junk) {
+            _keepLine();
+        }
+    }
+    _line.clear();
+    _lineKept = false;
+    _lineDropped = false;
+    _lineHasText = false;
+    _lineSpecial = 0;
+}
+
+void ResponseFilter::_keepLine() {
+    if (!_lineKept) {
+        _lineKept = true;
+        if (_keptLines++ > 0) _emit('\n');
+    }
+    for (char c : _line) _emit(c);
+    _line.clear();
+}
+
+// Leading whitespace is dropped; other whitespace waits for the next visible byte
+void ResponseFilter::_emit(char c) {
+    if (c == ' ' || c == '\n' || c == '\r') {
+        if (_emittedAny) _held += c;
+        return;
+    }
+    *_out += _held;
+    _held.clear();
+    *_out += c;
+    _emittedAny = true;
+}
+
+void StopMatcher::reset(std::vector<std::string> stops) {
+    _stops.clear();
+    for (auto& stop : stops) {
+        if (!stop.empty()) _stops.push_back(std::move(stop));
+    }
+    _held.clear();
+}
+
+std::string StopMatcher::feed(const std::string& piece, bool& stopped) {
+    stopped = false;
+    if (_stops.empty()) return piece;
+
+    // Only the held tail plus the new piece can contain a new match
+    std::string text = _held + piece;
+    _held.clear();
+
+    size_t first = std::string::npos;
+    for (const auto& stop : _stops) {
+        first = std::min(first, text.find(stop));
+    }
+    if (first != std::string::npos) {
+        stopped = true;
+        return text.substr(0, first);
+    }
+
+    // Hold the longest tail that is a prefix of some stop string
+    size_t hold = 0;
+    for (const auto& stop : _stops) {
+        for (size_t n = std::min(stop.size() - 1, text.size()); n > hold; --n) {
+            if (text.compare(text.size() - n, n, stop, 0, n) == 0) {
+                hold = n;
+                break;
+            }
+        }
+    }
+    _held = text.substr(text.size() - hold);
+    text.resize(text.size() - hold);
+    return text;
+}
+
+std::string StopMatcher::finish() {
+    std::string out;
+    out.swap(_held);
+    return out;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// Incremental cleanup of generated text, replacing the old multi-pass
+// postProcessResponse. Chat-template tokens and junk patterns are stripped in a
+// single left-to-right pass over a pattern trie (longest match wins), runs of
+// four or more '{' are dropped, lines without real content are dropped, and
+// leading/trailing whitespace is trimmed. feed() returns the text that is final
+// so far and holds back only bytes that could still be part of a match.
+class ResponseFilter {
+public:
+    void reset(bool enabled = true);
+    std::string feed(const std::string& piece);
+    std::string finish();  // Flush at end of response; call reset() before reuse
+
+private:
+    bool _enabled = true;
+
+    // Pattern stage
+    std::string _pending;
+    const char* _skipUntil = nullptr;  // Inside a header/metadata block until this marker
+    size_t _skipFrom = 0;              // Where the skipped block's body starts in _pending
+    bool _dropNewlines = false;        // Right after a removed block
+
+    // Brace stage
+    int _braceRun = 0;
+
+    // Line stage
+    std::string _line;                 // Current line while it may still be junk
+    bool _lineKept = false;            // Current line already judged as content
+    bool _lineDropped = false;         // Rest of current line is discarded
+    bool _lineHasText = false;
+    int _lineSpecial = 0;
+    int _keptLines = 0;
+
+    // Output
+    std::string _held;                 // Whitespace that is only emitted if more text follows
+    bool _emittedAny = false;
+    std::string* _out = nullptr;
+
+    void _process(bool final);
+    void _braces(char c);
+    void _lineChar(char c);
+    void _endLine();
+    void _keepLine();
+    void _emit(char c);
+};
+
+// Ends generation at the first stop string. Text that could be the start of a
+// stop string is held back until it either completes the match (and is
+// dropped) or diverges (and is released).
+class StopMatcher {
+public:
+    void reset(std::vector<std::string> stops);
+    bool empty() const { return _stops.empty(); }
+    std::string feed(const std::string& piece, bool& stopped);
+    std::string finish();  // Releases held text when generation ends for another reason
+
+private:
+    std::vector<std::string> _stops;
+    std::string _held;
+};
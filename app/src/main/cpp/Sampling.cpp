@@ -0,0 +1,254 @@
+#include "Sampling.h"
+#include "Logging.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+#include <json-schema-to-grammar.h>
+#include <nlohmann/json.hpp>
+
+#define TAG "HaloAI-Sampling"
+#define LOGI(...) Logging::write(Logging::Level::Info, TAG, __VA_ARGS__)
+#define LOGE(...) Logging::write(Logging::Level::Error, TAG, __VA_ARGS__)
+
+bool SamplerParams::operator==(const SamplerParams& other) const {
+    return temperature == other.temperature && topK == other.topK && topP == other.topP &&
+           minP == other.minP && repeatPenalty == other.repeatPenalty &&
+           frequencyPenalty == other.frequencyPenalty && presencePenalty == other.presencePenalty &&
+           penaltyLastN == other.penaltyLastN && seed == other.seed &&
+           jsonSchema == other.jsonSchema && grammar == other.grammar;
+}
+
+namespace Sampling {
+
+struct TopKTopP {
+    int k;
+    float p;
+};
+
+static bool byLogitDesc(const llama_token_data& a, const llama_token_data& b) {
+    return a.logit > b.logit;
+}
+
+// Sorted head a top-p-only cut starts from; grown 4x while it holds too little mass
+static constexpr size_t kNucleusHead = 64;
+
+static const char* topKTopPName(const llama_sampler*) {
+    return "top-k-top-p";
+}
+
+// Top-p without top-k. The nucleus is usually a small head of the vocabulary,
+// so sort a growing head until it holds p of the mass rather than all of it.
+static void nucleusApply(llama_token_data_array* cur, float p) {
+    llama_token_data* data = cur->data;
+    size_t n = cur->size;
+
+    float maxLogit = data[0].logit;
+    for (size_t i = 1; i < n; ++i) {
+        maxLogit = std::max(maxLogit, data[i].logit);
+    }
+    float total = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        data[i].p = expf(data[i].logit - maxLogit);
+        total += data[i].p;
+    }
+
+    float threshold = p * total;
+    float cumulative = 0.0f;
+    size_t sorted = 0;
+    size_t head = std::min(n, kNucleusHead);
+    while (true) {
+        // Everything past sorted ranks below the head already sorted
+        if (head < n) {
+            std::nth_element(data + sorted, data + head - 1, data + n, byLogitDesc);
+        }
+        std::sort(data + sorted, data + head, byLogitDesc);
+        for (size_t i = sorted; i < head; ++i) {
+            cumulative += data[i].p;
+            if (cumulative >= threshold) {
+                cur->size = i + 1;
+                cur->sorted = true;
+                return;
+            }
+        }
+        if (head == n) break;
+        sorted = head;
+        head = std::min(n, head * 4);
+    }
+    cur->sorted = true;
+}
+
+static void topKTopPApply(llama_sampler* smpl, llama_token_data_array* cur) {
+    const auto* params = static_cast<const TopKTopP*>(smpl->ctx);
+    size_t n = cur->size;
+    if (n <= 1) return;
+
+    if (params->k <= 0 && params->p < 1.0f && !cur->sorted) {
+        nucleusApply(cur, params->p);
+        return;
+    }
+
+    // Partial selection: O(n) to find the k best, then sort only those
+    size_t k = params->k > 0 ? std::min((size_t)params->k, n) : n;
+    if (!cur->sorted) {
+        if (k < n) {
+            std::nth_element(cur->data, cur->data + k - 1, cur->data + n, byLogitDesc);
+        }
+        std::sort(cur->data, cur->data + k, byLogitDesc);
+        cur->sorted = true;
+    }
+    cur->size = k;
+
+    // Nucleus cut over the survivors, as top_p does after top_k
+    if (params->p < 1.0f) {
+        float maxLogit = cur->data[0].logit;
+        float total = 0.0f;
+        for (size_t i = 0; i < k; ++i) {
+            cur->data[i].p = expf(cur->data[i].logit - maxLogit);
+            total += cur->data[i].p;
+        }
+
+        float threshold = params->p * total;
+        float cumulative = 0.0f;
+        size_t keep = k;
+        for (size_t i = 0; i < k; ++i) {
+            cumulative += cur->data[i].p;
+            if (cumulative >= threshold) {
+                keep = i + 1;
+                break;
+            }
+        }
+        cur->size = keep;
+    }
+}
+
+static llama_sampler* topKTopPClone(const llama_sampler* smpl) {
+    const auto* params = static_cast<const TopKTopP*>(smpl->ctx);
+    return initTopKTopP(params->k, params->p);
+}
+
+static void topKTopPFree(llama_sampler* smpl) {
+    delete static_cast<TopKTopP*>(smpl->ctx);
+}
+
+// Zero-initialized so fields added to llama_sampler_i upstream stay unset
+static const llama_sampler_i kTopKTopPInterface = [] {
+    llama_sampler_i iface{};
+    iface.name = topKTopPName;
+    iface.apply = topKTopPApply;
+    iface.clone = topKTopPClone;
+    iface.free = topKTopPFree;
+    return iface;
+}();
+
+llama_sampler* initTopKTopP(int k, float p) {
+    return llama_sampler_init(&kTopKTopPInterface, new TopKTopP{k, p});
+}
+
+llama_sampler* createChain(const SamplerParams& params) {
+    llama_sampler_chain_params chainParams = llama_sampler_chain_default_params();
+    chainParams.no_perf = true;
+    llama_sampler* chain = llama_sampler_chain_init(chainParams);
+
+    if (params.repeatPenalty != 1.0f || params.frequencyPenalty != 0.0f || params.presencePenalty != 0.0f) {
+        llama_sampler_chain_add(chain, llama_sampler_init_penalties(
+            params.penaltyLastN, params.repeatPenalty, params.frequencyPenalty, params.presencePenalty));
+    }
+
+    if (params.temperature <= 0.0f) {
+        llama_sampler_chain_add(chain, llama_sampler_init_greedy());
+        return chain;
+    }
+
+    if (params.topK > 0 || params.topP < 1.0f) {
+        llama_sampler_chain_add(chain, initTopKTopP(params.topK, params.topP));
+    }
+    if (params.minP > 0.0f) {
+        llama_sampler_chain_add(chain, llama_sampler_init_min_p(params.minP, 1));
+    }
+    llama_sampler_chain_add(chain, llama_sampler_init_temp(params.temperature));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(params.seed));
+    return chain;
+}
+
+static std::string compileToGbnf(const std::string& source, bool jsonSchema) {
+    if (!jsonSchema) {
+        return source;
+    }
+    try {
+        return json_schema_to_grammar(nlohmann::ordered_json::parse(source));
+    } catch (const std::exception& e) {
+        LOGE("Invalid JSON schema: %s", e.what());
+        return "";
+    }
+}
+
+llama_sampler* GrammarCache::acquire(const llama_vocab* vocab, const std::string& source, bool jsonSchema) {
+    size_t hash = std::hash<std::string>{}(source) ^ (jsonSchema ? 0x9e3779b97f4a7c15ULL : 0);
+    for (auto it = _entries.begin(); it != _entries.end(); ++it) {
+        if (it->hash == hash && it->jsonSchema == jsonSchema && it->source == source) {
+            // Move to the back so the least recently used entry is evicted first
+            Entry entry = *it;
+            _entries.erase(it);
+            _entries.push_back(entry);
+            return llama_sampler_clone(entry.prototype);
+        }
+    }
+
+    std::string gbnf = compileToGbnf(source, jsonSchema);
+    llama_sampler* prototype = gbnf.empty() ? nullptr : llama_sampler_init_grammar(vocab, gbnf.c_str(), "root");
+    if (!prototype) {
+        LOGE("Failed to compile grammar (%zu chars)", source.size());
+        return nullptr;
+    }
+    LOGI("Grammar compiled and cached (%zu chars of GBNF)", gbnf.size());
+
+    if (_entries.size() >= kMaxEntries) {
+        llama_sampler_free(_entries.front().prototype);
+        _entries.erase(_entries.begin());
+    }
+    _entries.push_back({hash, jsonSchema, source, prototype});
+    return llama_sampler_clone(prototype);
+}
+
+void GrammarCache::clear() {
+    for (auto& entry : _entries) {
+        llama_sampler_free(entry.prototype);
+    }
+    _entries.clear();
+}
+
+llama_token sampleConstrained(llama_sampler* chain, llama_sampler* grammar, llama_context* ctx,
+                              int idx, std::vector<llama_token_data>& candidates) {
+    const float* logits = llama_get_logits_ith(ctx, idx);
+    int nVocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+
+    auto fill = [&]() {
+        candidates.resize(nVocab);
+        for (int i = 0; i < nVocab; ++i) {
+            candidates[i] = {i, logits[i], 0.0f};
+        }
+        return llama_token_data_array{candidates.data(), candidates.size(), -1, false};
+    };
+
+    llama_token_data_array cur = fill();
+    llama_sampler_apply(chain, &cur);
+    llama_token token = cur.data[cur.selected].id;
+
+    // Usually the model already picks a legal token, so check just that one
+    llama_token_data single = {token, 1.0f, 0.0f};
+    llama_token_data_array check = {&single, 1, -1, false};
+    llama_sampler_apply(grammar, &check);
+    if (std::isinf(single.logit) && single.logit < 0) {
+        cur = fill();
+        llama_sampler_apply(grammar, &cur);
+        llama_sampler_apply(chain, &cur);
+        token = cur.data[cur.selected].id;
+    }
+
+    llama_sampler_accept(grammar, token);
+    llama_sampler_accept(chain, token);
+    return token;
+}
+
+} // namespace Sampling
@@ -0,0 +1,63 @@
+#pragma once
+#include "llama.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Per-request sampling settings; defaults match the previous fixed chain
+struct SamplerParams {
+    float temperature = 0.8f;       // <= 0 selects greedy decoding
+    int topK = 40;                  // <= 0 disables
+    float topP = 0.95f;             // >= 1 disables
+    float minP = 0.0f;              // <= 0 disables
+    float repeatPenalty = 1.0f;     // 1 disables
+    float frequencyPenalty = 0.0f;
+    float presencePenalty = 0.0f;
+    int penaltyLastN = 64;          // Recent tokens the penalties look at
+    uint32_t seed = LLAMA_DEFAULT_SEED;
+    std::string grammar;            // GBNF (or a JSON schema if jsonSchema); empty for none
+    bool jsonSchema = false;
+
+    bool operator==(const SamplerParams& other) const;
+    bool operator!=(const SamplerParams& other) const { return !(*this == other); }
+};
+
+namespace Sampling {
+
+// Build penalties -> top-k/top-p -> min-p -> temperature -> dist (or greedy)
+llama_sampler* createChain(const SamplerParams& params);
+
+// Fused top-k + top-p: selects the k best logits with nth_element and sorts
+// only those, instead of sorting the whole vocabulary as top_k/top_p do
+// separately. Top-p alone sorts a growing head until it holds p of the mass.
+// k <= 0 means no top-k; p >= 1 means no top-p.
+llama_sampler* initTopKTopP(int k, float p);
+
+// Compiled grammar samplers keyed by a hash of their source. acquire() hands
+// out a clone, which copies the parsed rules instead of re-parsing the GBNF;
+// nullptr if the grammar or schema is invalid. Tied to one vocabulary, so
+// clear() it when the model changes.
+class GrammarCache {
+public:
+    ~GrammarCache() { clear(); }
+    llama_sampler* acquire(const llama_vocab* vocab, const std::string& source, bool jsonSchema);
+    void clear();
+
+private:
+    struct Entry {
+        size_t hash;
+        bool jsonSchema;
+        std::string source;
+        llama_sampler* prototype;
+    };
+    static constexpr size_t kMaxEntries = 8;
+    std::vector<Entry> _entries;  // Least recently used first
+};
+
+// Sample under a grammar. The unconstrained choice is tried first and only that
+// one token is checked against the grammar; the full vocabulary is filtered
+// only when it is rejected. Accepts the token into both samplers.
+llama_token sampleConstrained(llama_sampler* chain, llama_sampler* grammar, llama_context* ctx,
+                              int idx, std::vector<llama_token_data>& candidates);
+
+} // namespace Sampling
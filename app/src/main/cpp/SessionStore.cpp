@@ -0,0 +1,130 @@
+#include "SessionStore.h"
+#include "Logging.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
+
+#define TAG "HaloAI-SessionStore"
+#define LOGI(...) Logging::write(Logging::Level::Info, TAG, __VA_ARGS__)
+#define LOGW(...) Logging::write(Logging::Level::Warn, TAG, __VA_ARGS__)
+
+namespace SessionStore {
+
+// FNV-1a over an arbitrary byte range
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t fingerprintModel(const char* modelPath) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = fnv1a(hash, modelPath, strlen(modelPath));
+
+    struct stat st {};
+    if (stat(modelPath, &st) == 0) {
+        int64_t size = st.st_size;
+        int64_t mtime = st.st_mtime;
+        hash = fnv1a(hash, &size, sizeof(size));
+        hash = fnv1a(hash, &mtime, sizeof(mtime));
+    }
+    return hash;
+}
+
+std::vector<uint8_t> encodeMessages(const std::vector<Message>& messages) {
+    std::vector<uint8_t> data;
+    auto put = [&data](const std::string& text) {
+        uint32_t len = (uint32_t)text.size();
+        const auto* lenBytes = reinterpret_cast<const uint8_t*>(&len);
+        data.insert(data.end(), lenBytes, lenBytes + sizeof(len));
+        data.insert(data.end(), text.begin(), text.end());
+    };
+    for (const Message& message : messages) {
+        put(message.first);
+        put(message.second);
+    }
+    return data;
+}
+
+bool decodeMessages(const std::vector<uint8_t>& data, std::vector<Message>& messages) {
+    messages.clear();
+    size_t pos = 0;
+    auto get = [&data, &pos](std::string& text) {
+        uint32_t len = 0;
+        if (data.size() - pos < sizeof(len)) return false;
+        memcpy(&len, data.data() + pos, sizeof(len));
+        pos += sizeof(len);
+        if (data.size() - pos < len) return false;
+        text.assign(reinterpret_cast<const char*>(data.data() + pos), len);
+        pos += len;
+        return true;
+    };
+    while (pos < data.size()) {
+        Message message;
+        if (!get(message.first) || !get(message.second)) {
+            messages.clear();
+            return false;
+        }
+        messages.push_back(std::move(message));
+    }
+    return true;
+}
+
+void touch(const char* path) {
+    utime(path, nullptr);
+}
+
+std::string parentDir(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? std::string() : path.substr(0, slash);
+}
+
+void prune(const std::string& dir, int64_t maxBytes) {
+    if (dir.empty() || maxBytes <= 0) return;
+
+    DIR* d = opendir(dir.c_str());
+    if (!d) return;
+
+    struct Entry {
+        std::string path;
+        int64_t size;
+        time_t mtime;
+    };
+    std::vector<Entry> entries;
+    int64_t total = 0;
+
+    while (dirent* ent = readdir(d)) {
+        if (ent->d_name[0] == '.') continue;
+        std::string path = dir + "/" + ent->d_name;
+        struct stat st {};
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        entries.push_back({path, (int64_t)st.st_size, st.st_mtime});
+        total += st.st_size;
+    }
+    closedir(d);
+
+    if (total <= maxBytes) return;
+
+    // Oldest first
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry& a, const Entry& b) { return a.mtime < b.mtime; });
+
+    for (const auto& entry : entries) {
+        if (total <= maxBytes) break;
+        if (remove(entry.path.c_str()) == 0) {
+            total -= entry.size;
+            LOGI("Evicted session snapshot %s (%lld bytes)", entry.path.c_str(), (long long)entry.size);
+        } else {
+            LOGW("Failed to evict %s", entry.path.c_str());
+        }
+    }
+}
+
+}  // namespace SessionStore
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// On-disk KV session snapshots: file header layout and LRU directory upkeep
+namespace SessionStore {
+
+constexpr uint32_t kMagic = 0x53564B48;  // "HKVS"
+constexpr uint32_t kVersion = 3;
+
+// Fixed-size header written in front of every snapshot file
+struct SnapshotHeader {
+    uint32_t magic = kMagic;
+    uint32_t version = kVersion;
+    uint64_t modelFingerprint = 0;  // See fingerprintModel()
+    uint32_t contextLength = 0;     // n_ctx the state was captured with
+    uint32_t kvTypeK = 0;           // ggml_type of the K and V caches
+    uint32_t kvTypeV = 0;
+    uint32_t tokenCount = 0;        // Tokens resident in the sequence
+    uint64_t stateSize = 0;         // Bytes of llama sequence state that follow the tokens
+    uint64_t messageBytes = 0;      // Encoded chat history that follows the state
+};
+
+using Message = std::pair<std::string, std::string>;  // Role, content
+
+// Chat history as stored in a snapshot: per message a u32 role length, the
+// role, a u32 content length and the content
+std::vector<uint8_t> encodeMessages(const std::vector<Message>& messages);
+bool decodeMessages(const std::vector<uint8_t>& data, std::vector<Message>& messages);
+
+// Cheap identity for a model file: path, size and mtime (never reads the weights)
+uint64_t fingerprintModel(const char* modelPath);
+
+// Mark a snapshot as recently used
+void touch(const char* path);
+
+// Delete least recently used snapshots until the directory fits in maxBytes
+void prune(const std::string& dir, int64_t maxBytes);
+
+// Directory part of a file path ("" if there is none)
+std::string parentDir(const std::string& path);
+
+}  // namespace SessionStore
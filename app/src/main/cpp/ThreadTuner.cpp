@@ -0,0 +1,138 @@
+#include "ThreadTuner.h"
+#include <algorithm>
+#include <cstdio>
+#include <utility>
+
+void ThreadTuner::reset(int minThreads, int maxThreads, int startThreads, bool probe) {
+    _minThreads = std::max(1, minThreads);
+    _maxThreads = std::max(_minThreads, maxThreads);
+    _threads = std::min(std::max(startThreads, _minThreads), _maxThreads);
+    _settled = false;
+    _sinceProbe = 0;
+    if (probe && _maxThreads > _minThreads) {
+        _startProbe();
+    } else {
+        _phase = Phase::Baseline;
+        _switchTo(_threads);
+    }
+}
+
+// The current count goes first so a round that finds nothing better costs little
+void ThreadTuner::_startProbe() {
+    _candidates.clear();
+    _candidates.push_back(_threads);
+    for (int n = _maxThreads; n >= _minThreads; n--) {
+        if (n != _threads) _candidates.push_back(n);
+    }
+    _candidate = 0;
+    _bestMs = 0;
+    _phase = Phase::Probing;
+    _switchTo(_candidates[0]);
+}
+
+void ThreadTuner::_switchTo(int threads) {
+    _threads = threads;
+    _skip = kWarmupTokens;
+    _samples.clear();
+}
+
+float ThreadTuner::_median(std::vector<float> samples) {
+    std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+    return samples[samples.size() / 2];
+}
+
+int ThreadTuner::record(float decodeMs) {
+    if (_skip > 0) {
+        _skip--;
+        return _threads;
+    }
+
+    switch (_phase) {
+        case Phase::Probing: {
+            _samples.push_back(decodeMs);
+            if ((int)_samples.size() < kProbeTokens) break;
+            float ms = _median(_samples);
+            if (_bestMs == 0 || ms < _bestMs) {
+                _bestMs = ms;
+                _bestThreads = _threads;
+            }
+            if (++_candidate < _candidates.size()) {
+                _switchTo(_candidates[_candidate]);
+                break;
+            }
+            _phase = Phase::Settled;
+            _settled = true;
+            _baselineMs = _bestMs;
+            _averageMs = _bestMs;
+            _sinceProbe = 0;
+            _switchTo(_bestThreads);
+            break;
+        }
+        case Phase::Baseline:
+            _samples.push_back(decodeMs);
+            if ((int)_samples.size() < kProbeTokens) break;
+            _baselineMs = _median(_samples);
+            _averageMs = _baselineMs;
+            _sinceProbe = 0;
+            _phase = Phase::Settled;
+            break;
+        case Phase::Settled:
+            _averageMs = 0.9f * _averageMs + 0.1f * decodeMs;
+            if (++_sinceProbe < kCooldownTokens || _maxThreads == _minThreads) break;
+            // Slower: throttling or contention may now favour fewer threads.
+            // Faster: whatever forced the current choice has passed.
+            if (_averageMs > _baselineMs * kDriftRatio || _averageMs * kDriftRatio < _baselineMs) {
+                _startProbe();
+            }
+            break;
+    }
+    return _threads;
+}
+
+bool ThreadTuner::takeSettled() {
+    bool settled = _settled;
+    _settled = false;
+    return settled;
+}
+
+int ThreadTuner::loadSaved(const std::string& path, uint64_t key) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) return 0;
+
+    unsigned long long lineKey = 0;
+    int threads = 0;
+    int found = 0;
+    while (fscanf(file, "%llx %d", &lineKey, &threads) == 2) {
+        if (lineKey == key) found = threads;
+    }
+    fclose(file);
+    return found;
+}
+
+// Rewrites the whole file through a temporary, replacing key's previous entry
+bool ThreadTuner::save(const std::string& path, uint64_t key, int threads) {
+    std::vector<std::pair<unsigned long long, int>> entries;
+    if (FILE* file = fopen(path.c_str(), "r")) {
+        unsigned long long lineKey = 0;
+        int lineThreads = 0;
+        while (fscanf(file, "%llx %d", &lineKey, &lineThreads) == 2) {
+            if (lineKey != key) entries.emplace_back(lineKey, lineThreads);
+        }
+        fclose(file);
+    }
+    entries.emplace_back(key, threads);
+
+    std::string tmp = path + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "w");
+    if (!file) return false;
+    bool ok = true;
+    for (const auto& entry : entries) {
+        ok = ok && fprintf(file, "%016llx %d\n", entry.first, entry.second) > 0;
+    }
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Chooses the decode thread count from measured per-token latency. It first
+// probes each candidate count for a few tokens and keeps the fastest. It then
+// tracks a moving average and probes again when that drifts from the chosen
+// count's baseline (thermal throttling, background load).
+class ThreadTuner {
+public:
+    static constexpr int kWarmupTokens = 2;     // Discarded after each switch
+    static constexpr int kProbeTokens = 8;      // Measured per candidate
+    static constexpr int kCooldownTokens = 128; // Minimum between re-probes
+    static constexpr float kDriftRatio = 1.3f;  // Average vs baseline that triggers a re-probe
+
+    // Candidates are minThreads..maxThreads. With probe false the tuner starts
+    // settled on startThreads (e.g. a saved value) and only measures its baseline.
+    void reset(int minThreads, int maxThreads, int startThreads, bool probe);
+
+    // Records one single-token decode; returns the thread count for the next one
+    int record(float decodeMs);
+
+    int threads() const { return _threads; }
+    bool probing() const { return _phase == Phase::Probing; }
+    // True once after each probe round picks a count, so it can be saved
+    bool takeSettled();
+
+    // Tuned counts persisted as "<key hex> <threads>" lines; 0 if none saved
+    static int loadSaved(const std::string& path, uint64_t key);
+    static bool save(const std::string& path, uint64_t key, int threads);
+
+private:
+    enum class Phase { Probing, Baseline, Settled };
+
+    void _startProbe();
+    void _switchTo(int threads);
+    static float _median(std::vector<float> samples);
+
+    Phase _phase = Phase::Settled;
+    int _minThreads = 1;
+    int _maxThreads = 1;
+    int _threads = 1;
+    int _skip = 0;                   // Warmup tokens left at the current count
+    std::vector<float> _samples;     // Current count's measurements
+    std::vector<int> _candidates;    // Probe order, fastest-looking first
+    size_t _candidate = 0;
+    int _bestThreads = 1;
+    float _bestMs = 0;
+    float _baselineMs = 0;
+    float _averageMs = 0;            // Exponential moving average while settled
+    int _sinceProbe = 0;
+    bool _settled = false;
+};
@@ -0,0 +1,160 @@
+#include "Utf8.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+const char kReplacement[] = "\xEF\xBF\xBD";
+
+// Length of the leading run of ASCII bytes
+size_t asciiPrefix(const unsigned char* p, size_t n) {
+    size_t i = 0;
+#if defined(__aarch64__)
+    for (; i + 16 <= n; i += 16) {
+        if (vmaxvq_u8(vld1q_u8(p + i)) >= 0x80) break;
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        if (_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)))) break;
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        if (word & 0x8080808080808080ULL) break;
+    }
+    while (i < n && p[i] < 0x80) ++i;
+    return i;
+}
+
+// Decodes one non-ASCII sequence. Returns its length, 0 if the bytes are a
+// valid but truncated prefix, or -1 if invalid.
+int decode(const unsigned char* p, size_t n, uint32_t& cp) {
+    unsigned char lead = p[0];
+    int len;
+    unsigned char lo = 0x80, hi = 0xBF;  // Allowed range of the second byte
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        len = 2;
+        cp = lead & 0x1F;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        len = 3;
+        cp = lead & 0x0F;
+        if (lead == 0xE0) lo = 0xA0;       // Overlong
+        else if (lead == 0xED) hi = 0x9F;  // Surrogates
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        len = 4;
+        cp = lead & 0x07;
+        if (lead == 0xF0) lo = 0x90;       // Overlong
+        else if (lead == 0xF4) hi = 0x8F;  // Past U+10FFFF
+    } else {
+        return -1;
+    }
+
+    for (int i = 1; i < len; ++i) {
+        if ((size_t)i >= n) return 0;
+        unsigned char c = p[i];
+        if (i == 1 ? (c < lo || c > hi) : (c & 0xC0) != 0x80) return -1;
+        cp = (cp << 6) | (c & 0x3F);
+    }
+    return len;
+}
+
+} // namespace
+
+namespace Utf8 {
+
+bool isValid(const char* data, size_t len) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    size_t i = 0;
+    while (true) {
+        i += asciiPrefix(p + i, len - i);
+        if (i == len) return true;
+        uint32_t cp;
+        int n = decode(p + i, len - i, cp);
+        if (n <= 0) return false;
+        i += n;
+    }
+}
+
+std::u16string toUtf16(const char* data, size_t len) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    std::u16string out;
+    out.reserve(len);
+    size_t i = 0;
+    while (i < len) {
+        size_t ascii = asciiPrefix(p + i, len - i);
+        out.append(p + i, p + i + ascii);
+        i += ascii;
+        if (i == len) break;
+
+        uint32_t cp;
+        int n = decode(p + i, len - i, cp);
+        if (n <= 0) {
+            out.push_back(0xFFFD);
+            i++;
+            continue;
+        }
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            out.push_back((char16_t)(0xD800 + (cp >> 10)));
+            out.push_back((char16_t)(0xDC00 + (cp & 0x3FF)));
+        } else {
+            out.push_back((char16_t)cp);
+        }
+        i += n;
+    }
+    return out;
+}
+
+std::string Assembler::push(const std::string& piece) {
+    std::string buf;
+    if (_carry.empty()) {
+        buf = piece;
+    } else {
+        buf = _carry + piece;
+        _carry.clear();
+    }
+
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(buf.data());
+    size_t len = buf.size();
+    size_t i = 0;
+    size_t good = 0;  // buf[good, i) is valid and not yet copied to out
+    std::string out;
+    while (true) {
+        i += asciiPrefix(p + i, len - i);
+        if (i == len) break;
+        uint32_t cp;
+        int n = decode(p + i, len - i, cp);
+        if (n > 0) {
+            i += n;
+            continue;
+        }
+        out.append(buf, good, i - good);
+        if (n == 0) {
+            _carry.assign(buf, i, len - i);
+            good = i = len;
+            break;
+        }
+        out += kReplacement;
+        good = ++i;
+    }
+
+    // Common case: the whole piece was complete and valid
+    if (good == 0 && i == len) return buf;
+    out.append(buf, good, len - good);
+    return out;
+}
+
+std::string Assembler::flush() {
+    std::string out = _carry.empty() ? "" : kReplacement;
+    _carry.clear();
+    return out;
+}
+
+} // namespace Utf8
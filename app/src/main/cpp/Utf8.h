@@ -0,0 +1,32 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// UTF-8 handling for streamed token text. Tokens can end in the middle of a
+// multibyte character, and Java's NewStringUTF expects Modified UTF-8, so
+// text is reassembled here and handed to the JVM as UTF-16 unless isValid
+// shows it can go through NewStringUTF unchanged.
+namespace Utf8 {
+
+// Strict validation (no overlongs, surrogates or code points past U+10FFFF);
+// ASCII runs are checked 16 bytes at a time with NEON/SSE2 where available
+bool isValid(const char* data, size_t len);
+inline bool isValid(const std::string& text) { return isValid(text.data(), text.size()); }
+
+// Decodes to UTF-16, replacing invalid bytes with U+FFFD
+std::u16string toUtf16(const char* data, size_t len);
+inline std::u16string toUtf16(const std::string& text) { return toUtf16(text.data(), text.size()); }
+
+// Joins token pieces into whole characters: an incomplete sequence at the end
+// of a piece is carried into the next one, invalid bytes become U+FFFD
+class Assembler {
+public:
+    std::string push(const std::string& piece);
+    std::string flush();  // End of stream: a dangling partial character becomes U+FFFD
+    void clear() { _carry.clear(); }
+
+private:
+    std::string _carry;  // At most 3 bytes
+};
+
+} // namespace Utf8
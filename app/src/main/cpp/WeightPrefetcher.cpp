@@ -0,0 +1,87 @@
+#include "WeightPrefetcher.h"
+#include "Logging.h"
+#include "MemoryPlanner.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TAG "HaloAI-Prefetch"
+#define LOGI(...) Logging::write(Logging::Level::Info, TAG, __VA_ARGS__)
+#define LOGW(...) Logging::write(Logging::Level::Warn, TAG, __VA_ARGS__)
+
+namespace {
+
+constexpr size_t kChunkBytes = 16 * 1024 * 1024;  // Cancellation granularity
+
+}  // namespace
+
+void WeightPrefetcher::start(const std::string& path) {
+    stop();
+    _stop.store(false);
+    _done.store(false);
+    _thread = std::thread(&WeightPrefetcher::_run, this, path);
+}
+
+void WeightPrefetcher::stop() {
+    _stop.store(true);
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+}
+
+// Readahead hints first, then one read per page through a private mapping:
+// the hints are advisory and capped by the kernel, the reads are not
+void WeightPrefetcher::_run(std::string path) {
+    auto start = std::chrono::steady_clock::now();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        LOGW("Cannot open %s for prefetch", path.c_str());
+        _done.store(true);
+        return;
+    }
+
+    struct stat st;
+    size_t size = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    // A file larger than free memory would evict its own first pages (and the
+    // rest of the app's) before llama.cpp touches them
+    uint64_t available = MemoryPlanner::availableBytes();
+    if (available > 0 && size > available) {
+        LOGI("Skipping prefetch: %.0f MB model, %.0f MB available", size / (1024.0 * 1024.0),
+             available / (1024.0 * 1024.0));
+        close(fd);
+        _done.store(true);
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    void* map = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOGW("Cannot map %s for prefetch", path.c_str());
+        _done.store(true);
+        return;
+    }
+    madvise(map, size, MADV_WILLNEED);
+
+    const auto* bytes = static_cast<const volatile uint8_t*>(map);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t touched = 0;
+    uint8_t sink = 0;
+    while (touched < size && !_stop.load(std::memory_order_relaxed)) {
+        size_t end = std::min(size, touched + kChunkBytes);
+        for (size_t offset = touched; offset < end; offset += page) {
+            sink ^= bytes[offset];
+        }
+        touched = end;
+    }
+    (void)sink;
+    munmap(map, size);
+
+    float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    LOGI("Prefetched %.0f of %.0f MB in %.0f ms%s", touched / (1024.0 * 1024.0), size / (1024.0 * 1024.0), ms,
+         touched < size ? " (stopped)" : "");
+    _done.store(true);
+}
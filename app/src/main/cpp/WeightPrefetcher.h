@@ -0,0 +1,23 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include <thread>
+
+// Reads a model file into the page cache on a background thread, so the
+// mmap'd weights are already resident when the first decode touches them.
+// Skipped when the file is larger than MemAvailable.
+class WeightPrefetcher {
+public:
+    ~WeightPrefetcher() { stop(); }
+
+    void start(const std::string& path);  // Replaces any prefetch in progress
+    void stop();                          // Cancels and joins
+    bool done() const { return _done.load(); }
+
+private:
+    void _run(std::string path);
+
+    std::thread _thread;
+    std::atomic<bool> _stop{false};
+    std::atomic<bool> _done{false};
+};
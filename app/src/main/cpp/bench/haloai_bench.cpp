@@ -0,0 +1,337 @@
+// Host benchmark for the native engine: loads a GGUF, replays scripted
+// conversations through startCompletion/completionLoop and prints JSON.
+//
+// Script format: one user turn per line, "---" starts a new conversation,
+// lines starting with '#' are ignored.
+
+#include "LLMInference.h"
+#include "Logging.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <string>
+#include <vector>
+
+struct BenchOptions {
+    std::string modelPath;
+    std::string scriptPath;
+    int threads = 4;
+    int contextLength = 4096;
+    int maxTokens = 128;
+    int repeat = 1;
+    int sessions = 0;
+    KvCacheType kvCacheType = KvCacheType::F16;
+    bool flashAttention = false;
+    WarmupOptions warmup;
+    bool verbose = false;
+    SamplerParams sampling;
+    std::vector<std::string> stop;
+};
+
+struct TurnResult {
+    int conversation = 0;
+    int turn = 0;
+    int generatedTokens = 0;
+    int sessionTokens = 0;      // Tokens from batched side sessions during this turn
+    float wallMs = 0;
+    PerfMetrics perf;
+};
+
+using Conversation = std::vector<std::string>;
+
+static const std::vector<Conversation> kDefaultScript = {
+    {
+        "What is the capital of France?",
+        "Tell me three facts about it.",
+        "Summarize those facts in one sentence.",
+    },
+    {
+        "Write a short poem about the sea.",
+        "Now make it rhyme.",
+    },
+};
+
+static void quietSink(Logging::Level level, const char* tag, const char* message) {
+    if (level != Logging::Level::Info) {
+        fprintf(stderr, "%s: %s\n", tag, message);
+    }
+}
+
+static void printUsage(const char* argv0) {
+    fprintf(stderr,
+        "usage: %s -m model.gguf [options]\n"
+        "  -s, --script FILE       conversation script (default: built-in)\n"
+        "  -t, --threads N         worker threads, 0 = per CPU topology (default 4)\n"
+        "  -c, --ctx N             context length, 0 = memory planner (default 4096)\n"
+        "  -n, --max-tokens N      tokens generated per turn (default 128)\n"
+        "  -r, --repeat N          run the whole script N times (default 1)\n"
+        "  -p, --sessions N        batched side sessions decoding each turn alongside (default 0)\n"
+        "      --kv TYPE           KV cache type: f16, q8_0, q4_0 or auto (default f16)\n"
+        "      --flash-attn        enable flash attention\n"
+        "      --warmup            prefetch weights and run a dummy decode while loading\n"
+        "      --mlock-mb N        with --warmup, lock weights of at most N MB in RAM\n"
+        "      --temp T            sampling temperature, <= 0 for greedy (default 0.8)\n"
+        "      --top-k N           top-k, <= 0 disables (default 40)\n"
+        "      --top-p P           top-p, >= 1 disables (default 0.95)\n"
+        "      --min-p P           min-p, <= 0 disables (default 0)\n"
+        "      --repeat-penalty R  repetition penalty (default 1.0)\n"
+        "      --seed N            sampler seed for reproducible runs (default random)\n"
+        "      --grammar FILE      constrain output with a GBNF grammar\n"
+        "      --json-schema FILE  constrain output with a JSON schema\n"
+        "      --stop STR          end a turn at STR (repeatable; \\n is a newline)\n"
+        "  -v, --verbose           keep engine info logs on stderr\n",
+        argv0);
+}
+
+static bool parseArgs(int argc, char** argv, BenchOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto next = [&]() -> const char* {
+            return i + 1 < argc ? argv[++i] : nullptr;
+        };
+        const char* value = nullptr;
+
+        if (arg == "-m" || arg == "--model") {
+            if (!(value = next())) return false;
+            options.modelPath = value;
+        } else if (arg == "-s" || arg == "--script") {
+            if (!(value = next())) return false;
+            options.scriptPath = value;
+        } else if (arg == "-t" || arg == "--threads") {
+            if (!(value = next())) return false;
+            options.threads = atoi(value);
+        } else if (arg == "-c" || arg == "--ctx") {
+            if (!(value = next())) return false;
+            options.contextLength = atoi(value);
+        } else if (arg == "-n" || arg == "--max-tokens") {
+            if (!(value = next())) return false;
+            options.maxTokens = atoi(value);
+        } else if (arg == "-r" || arg == "--repeat") {
+            if (!(value = next())) return false;
+            options.repeat = std::max(1, atoi(value));
+        } else if (arg == "-p" || arg == "--sessions") {
+            if (!(value = next())) return false;
+            options.sessions = std::max(0, atoi(value));
+        } else if (arg == "--kv") {
+            if (!(value = next())) return false;
+            if (strcmp(value, "q8_0") == 0) options.kvCacheType = KvCacheType::Q8_0;
+            else if (strcmp(value, "q4_0") == 0) options.kvCacheType = KvCacheType::Q4_0;
+            else if (strcmp(value, "f16") == 0) options.kvCacheType = KvCacheType::F16;
+            else if (strcmp(value, "auto") == 0) options.kvCacheType = KvCacheType::Auto;
+            else return false;
+        } else if (arg == "--temp") {
+            if (!(value = next())) return false;
+            options.sampling.temperature = (float)atof(value);
+        } else if (arg == "--top-k") {
+            if (!(value = next())) return false;
+            options.sampling.topK = atoi(value);
+        } else if (arg == "--top-p") {
+            if (!(value = next())) return false;
+            options.sampling.topP = (float)atof(value);
+        } else if (arg == "--min-p") {
+            if (!(value = next())) return false;
+            options.sampling.minP = (float)atof(value);
+        } else if (arg == "--repeat-penalty") {
+            if (!(value = next())) return false;
+            options.sampling.repeatPenalty = (float)atof(value);
+        } else if (arg == "--seed") {
+            if (!(value = next())) return false;
+            options.sampling.seed = (uint32_t)strtoul(value, nullptr, 10);
+        } else if (arg == "--grammar" || arg == "--json-schema") {
+            if (!(value = next())) return false;
+            std::ifstream in(value);
+            if (!in) return false;
+            options.sampling.grammar.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            options.sampling.jsonSchema = arg == "--json-schema";
+        } else if (arg == "--stop") {
+            if (!(value = next())) return false;
+            std::string stop = value;
+            for (size_t pos; (pos = stop.find("\\n")) != std::string::npos; ) {
+                stop.replace(pos, 2, "\n");
+            }
+            options.stop.push_back(stop);
+        } else if (arg == "--flash-attn") {
+            options.flashAttention = true;
+        } else if (arg == "--warmup") {
+            options.warmup.enabled = true;
+        } else if (arg == "--mlock-mb") {
+            if (!(value = next())) return false;
+            options.warmup.mlockMaxBytes = (uint64_t)std::max(0, atoi(value)) * 1024 * 1024;
+        } else if (arg == "-v" || arg == "--verbose") {
+            options.verbose = true;
+        } else {
+            return false;
+        }
+    }
+    return !options.modelPath.empty();
+}
+
+static bool loadScript(const std::string& path, std::vector<Conversation>& script) {
+    std::ifstream in(path);
+    if (!in) return false;
+
+    Conversation current;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        if (line == "---") {
+            if (!current.empty()) script.push_back(std::move(current));
+            current.clear();
+            continue;
+        }
+        current.push_back(line);
+    }
+    if (!current.empty()) script.push_back(std::move(current));
+    return !script.empty();
+}
+
+static float perSecond(int tokens, float ms) {
+    return ms > 0 ? tokens * 1000.0f / ms : 0.0f;
+}
+
+// Minimal JSON string escaping for the model path
+static std::string jsonEscape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+static void printJson(const BenchOptions& options, const PerfMetrics& loadPerf,
+                      const std::vector<TurnResult>& turns, long peakRssKb) {
+    int prefillTokens = 0, decodeTokens = 0;
+    float prefillMs = 0, decodeMs = 0, ttftMs = 0;
+    for (const auto& t : turns) {
+        prefillTokens += t.perf.prefillTokens;
+        prefillMs += t.perf.prefillMs;
+        decodeTokens += t.perf.decodeTokens;
+        decodeMs += t.perf.decodeMs;
+        ttftMs += t.perf.ttftMs;
+    }
+
+    printf("{\n");
+    printf("  \"model\": \"%s\",\n", jsonEscape(options.modelPath).c_str());
+    printf("  \"threads\": %d,\n", options.threads);
+    printf("  \"context_length\": %d,\n", options.contextLength);
+    printf("  \"max_tokens\": %d,\n", options.maxTokens);
+    printf("  \"sessions\": %d,\n", options.sessions);
+    printf("  \"load_ms\": %.2f,\n", loadPerf.loadMs);
+    printf("  \"page_in_ms\": %.2f,\n", loadPerf.pageInMs);
+    printf("  \"warmup_ms\": %.2f,\n", loadPerf.warmupMs);
+    printf("  \"turns\": [\n");
+    for (size_t i = 0; i < turns.size(); ++i) {
+        const auto& t = turns[i];
+        printf("    {\"conversation\": %d, \"turn\": %d, \"prefill_tokens\": %d, \"prefill_ms\": %.2f, "
+               "\"prefill_tok_s\": %.2f, \"ttft_ms\": %.2f, \"decode_tokens\": %d, \"decode_ms\": %.2f, "
+               "\"decode_tok_s\": %.2f, \"decode_p50_ms\": %.2f, \"decode_p95_ms\": %.2f, "
+               "\"decode_p99_ms\": %.2f, \"sample_ms\": %.2f, \"detokenize_ms\": %.2f, "
+               "\"session_tokens\": %d, \"total_tok_s\": %.2f}%s\n",
+               t.conversation, t.turn, t.perf.prefillTokens, t.perf.prefillMs,
+               perSecond(t.perf.prefillTokens, t.perf.prefillMs), t.perf.ttftMs,
+               t.perf.decodeTokens, t.perf.decodeMs, perSecond(t.perf.decodeTokens, t.perf.decodeMs),
+               t.perf.decodeP50Ms, t.perf.decodeP95Ms, t.perf.decodeP99Ms,
+               t.perf.sampleMs, t.perf.detokenizeMs, t.sessionTokens,
+               perSecond(t.generatedTokens + t.sessionTokens, t.wallMs), i + 1 < turns.size() ? "," : "");
+    }
+    printf("  ],\n");
+    printf("  \"summary\": {\"turns\": %zu, \"prefill_tok_s\": %.2f, \"decode_tok_s\": %.2f, "
+           "\"mean_ttft_ms\": %.2f, \"peak_rss_kb\": %ld}\n",
+           turns.size(), perSecond(prefillTokens, prefillMs), perSecond(decodeTokens, decodeMs),
+           turns.empty() ? 0.0f : ttftMs / turns.size(), peakRssKb);
+    printf("}\n");
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    if (!parseArgs(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 2;
+    }
+    if (!options.verbose) {
+        Logging::setSink(quietSink);
+    }
+
+    std::vector<Conversation> script;
+    if (options.scriptPath.empty()) {
+        script = kDefaultScript;
+    } else if (!loadScript(options.scriptPath, script)) {
+        fprintf(stderr, "failed to read script: %s\n", options.scriptPath.c_str());
+        return 1;
+    }
+
+    LLMInference llm;
+    llm.setWarmup(options.warmup);
+    if (!llm.loadModel(options.modelPath.c_str(), options.threads, options.contextLength,
+                       options.sampling.temperature, true, options.kvCacheType, options.flashAttention)) {
+        fprintf(stderr, "failed to load model: %s\n", options.modelPath.c_str());
+        return 1;
+    }
+
+    PerfMetrics loadPerf;
+    std::vector<TurnResult> turns;
+    for (int pass = 0; pass < options.repeat; ++pass) {
+        for (size_t c = 0; c < script.size(); ++c) {
+            llm.startFreshConversation();
+            for (size_t t = 0; t < script[c].size(); ++t) {
+                if (!llm.startCompletion(script[c][t].c_str(), nullptr, &options.sampling, options.stop)) {
+                    fprintf(stderr, "startCompletion failed (conversation %zu, turn %zu)\n", c, t);
+                    return 1;
+                }
+
+                TurnResult result;
+                result.conversation = (int)c;
+                result.turn = (int)t;
+                auto turnStart = std::chrono::steady_clock::now();
+
+                // Side sessions share the chat's decode steps, then finish on the scheduler
+                std::atomic<int> sessionTokens{0};
+                for (int p = 0; p < options.sessions; ++p) {
+                    llm.openSession(script[c][t].c_str(), options.maxTokens,
+                        [&sessionTokens](int, const std::string&, bool finished) {
+                            if (!finished) sessionTokens++;
+                            return true;
+                        });
+                }
+
+                while (result.generatedTokens < options.maxTokens) {
+                    std::string piece = llm.completionLoop();
+                    if (piece == "[EOG]" || piece == "[ERROR]") break;
+                    result.generatedTokens++;
+                }
+                llm.stopCompletion();
+                while (llm.getActiveSessionCount() > 0) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                result.sessionTokens = sessionTokens.load();
+                result.wallMs = std::chrono::duration<float, std::milli>(
+                    std::chrono::steady_clock::now() - turnStart).count();
+
+                result.perf = llm.getPerfMetrics();
+                // Page-in is only observed on the very first decode after load
+                if (turns.empty()) loadPerf = result.perf;
+                turns.push_back(result);
+            }
+        }
+    }
+
+    printJson(options, loadPerf, turns, llm.getPerfMetrics().peakRssKb);
+    llm.freeModel();
+    return 0;
+}
@@ -1,13 +1,33 @@
 #include <jni.h>
-#include <android/log.h>
+#include <pthread.h>
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
 #include "LLMInference.h"
+#include "MemoryPlanner.h"
+#include "SessionStore.h"
+#include "Logging.h"
+#include "Utf8.h"
 
 #define TAG "HaloAI-JNI"
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
+#define LOGI(...) Logging::write(Logging::Level::Info, TAG, __VA_ARGS__)
+#define LOGE(...) Logging::write(Logging::Level::Error, TAG, __VA_ARGS__)
 
 // HaloAI Default JNI Bridge - Using your app's default signatures
 
+// NewStringUTF expects Modified UTF-8 and rejects 4-byte sequences (emoji).
+// Valid text without those or NULs is already Modified UTF-8 and goes straight
+// through; anything else is converted to UTF-16, invalid bytes becoming U+FFFD.
+static jstring toJString(JNIEnv* env, const std::string& text) {
+    bool plain = std::none_of(text.begin(), text.end(),
+                              [](char c) { return c == '\0' || (unsigned char)c >= 0xF0; });
+    if (plain && Utf8::isValid(text)) {
+        return env->NewStringUTF(text.c_str());
+    }
+    std::u16string utf16 = Utf8::toUtf16(text);
+    return env->NewString(reinterpret_cast<const jchar*>(utf16.data()), (jsize)utf16.size());
+}
+
 // Get model metadata before loading (lightweight)
 extern "C" JNIEXPORT jobject JNICALL
 Java_com_rapo_haloai_data_model_GGUFModelRuntime_getModelMetadata(
@@ -30,15 +50,18 @@ Java_com_rapo_haloai_data_model_GGUFModelRuntime_getModelMetadata(
     }
 
     // Get constructor
-    jmethodID constructor = env->GetMethodID(metadataClass, "<init>", "(ILjava/lang/String;Ljava/lang/String;Z)V");
+    jmethodID constructor = env->GetMethodID(metadataClass, "<init>",
+        "(ILjava/lang/String;Ljava/lang/String;ZLjava/lang/String;Ljava/lang/String;JIIIIIJ)V");
     if (!constructor) {
         LOGE("Failed to find ModelMetadata constructor");
         return nullptr;
     }
 
     // Create strings
-    jstring chatTemplate = env->NewStringUTF(metadata.chatTemplate.c_str());
-    jstring architecture = env->NewStringUTF(metadata.architecture.c_str());
+    jstring chatTemplate = toJString(env, metadata.chatTemplate);
+    jstring architecture = toJString(env, metadata.architecture);
+    jstring name = toJString(env, metadata.name);
+    jstring quantization = toJString(env, metadata.quantization);
 
     // Create object
     jobject metadataObj = env->NewObject(
@@ -47,29 +70,99 @@ Java_com_rapo_haloai_data_model_GGUFModelRuntime_getModelMetadata(
         metadata.contextSize,
         chatTemplate,
         architecture,
-        metadata.valid
+        (jboolean)metadata.valid,
+        name,
+        quantization,
+        (jlong)metadata.parameterCount,
+        (jint)metadata.layerCount,
+        (jint)metadata.vocabSize,
+        (jint)metadata.embeddingLength,
+        (jint)metadata.headCount,
+        (jint)metadata.headCountKv,
+        (jlong)metadata.tensorBytes
     );
 
     env->DeleteLocalRef(chatTemplate);
     env->DeleteLocalRef(architecture);
+    env->DeleteLocalRef(name);
+    env->DeleteLocalRef(quantization);
     env->DeleteLocalRef(metadataClass);
 
     return metadataObj;
 }
 
+// Estimate the footprint of loading a model and pick the largest context and
+// KV cache type that fit budgetBytes (0: share of free memory). contextLength
+// <= 0 and kvCacheType AUTO are searched; other values are kept. flashAttention
+// is the setting the model will be loaded with.
+extern "C" JNIEXPORT jobject JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_planMemory(
+    JNIEnv* env,
+    jobject /* this */,
+    jstring modelPath,
+    jlong budgetBytes,
+    jint contextLength,
+    jint kvCacheType,
+    jboolean flashAttention
+) {
+    const char* path = env->GetStringUTFChars(modelPath, nullptr);
+    ModelMetadata metadata = LLMInference::getModelMetadata(path);
+    env->ReleaseStringUTFChars(modelPath, path);
+    if (!metadata.valid) {
+        return nullptr;
+    }
+
+    MemoryPlan plan = MemoryPlanner::plan(metadata, (uint64_t)std::max<jlong>(0, budgetBytes), contextLength,
+                                          static_cast<KvCacheType>(kvCacheType), flashAttention);
+
+    jclass planClass = env->FindClass("com/rapo/haloai/data/model/MemoryPlan");
+    if (!planClass) {
+        LOGE("Failed to find MemoryPlan class");
+        return nullptr;
+    }
+    jmethodID constructor = env->GetMethodID(planClass, "<init>", "(ZIIZIJJJJJJ)V");
+    jobject result = env->NewObject(
+        planClass,
+        constructor,
+        (jboolean)plan.fits,
+        (jint)plan.contextLength,
+        (jint)plan.kvCacheType,
+        (jboolean)plan.flashAttention,
+        (jint)plan.threads,
+        (jlong)plan.weightsBytes,
+        (jlong)plan.kvBytes,
+        (jlong)plan.computeBytes,
+        (jlong)plan.overheadBytes,
+        (jlong)plan.totalBytes,
+        (jlong)plan.budgetBytes
+    );
+    env->DeleteLocalRef(planClass);
+    return result;
+}
+
 extern "C" JNIEXPORT jlong JNICALL
 Java_com_rapo_haloai_data_model_GGUFModelRuntime_initModel(
     JNIEnv* env,
     jobject /* this */,
     jstring modelPath,
     jint threads,
-    jint contextLength
+    jint contextLength,
+    jfloat temperature,
+    jint kvCacheType,
+    jboolean flashAttention,
+    jboolean warmup,
+    jlong mlockMaxBytes
 ) {
     const char* path = env->GetStringUTFChars(modelPath, nullptr);
     LOGI("initModel called: %s", path);
 
     auto* llm = new LLMInference();
-    bool success = llm->loadModel(path, threads, contextLength, 0.8f, true);
+    WarmupOptions warmupOptions;
+    warmupOptions.enabled = warmup == JNI_TRUE;
+    warmupOptions.mlockMaxBytes = (uint64_t)std::max<jlong>(0, mlockMaxBytes);
+    llm->setWarmup(warmupOptions);
+    bool success = llm->loadModel(path, threads, contextLength, temperature, true,
+                                  static_cast<KvCacheType>(kvCacheType), flashAttention == JNI_TRUE);
 
     env->ReleaseStringUTFChars(modelPath, path);
 
@@ -83,6 +176,72 @@ Java_com_rapo_haloai_data_model_GGUFModelRuntime_initModel(
     return reinterpret_cast<jlong>(llm);
 }
 
+// Load a small draft model (same vocabulary) for speculative decoding
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_loadDraftModel(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jstring modelPath,
+    jint nDraft
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    if (!llm) return JNI_FALSE;
+
+    const char* path = env->GetStringUTFChars(modelPath, nullptr);
+    bool loaded = llm->loadDraftModel(path, nDraft);
+    env->ReleaseStringUTFChars(modelPath, path);
+
+    return loaded ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_freeDraftModel(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    if (llm) {
+        llm->freeDraftModel();
+    }
+}
+
+// Draft-free speculative decoding from n-gram matches in the prompt and output
+extern "C" JNIEXPORT void JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_setPromptLookup(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jboolean enabled,
+    jint ngramMax,
+    jint nDraft
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    if (llm) {
+        llm->setPromptLookup(enabled == JNI_TRUE, ngramMax, nDraft);
+    }
+}
+
+// Decode thread count tuned from measured latency; statePath (nullable) persists it
+extern "C" JNIEXPORT void JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_setThreadAutoTune(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jboolean enabled,
+    jstring statePath
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    if (!llm) return;
+
+    const char* path = statePath ? env->GetStringUTFChars(statePath, nullptr) : nullptr;
+    llm->setThreadAutoTune(enabled == JNI_TRUE, path);
+    if (path) {
+        env->ReleaseStringUTFChars(statePath, path);
+    }
+}
+
 // Add chat message manually
 extern "C" JNIEXPORT void JNICALL
 Java_com_rapo_haloai_data_model_GGUFModelRuntime_addChatMessage(
@@ -120,6 +279,22 @@ Java_com_rapo_haloai_data_model_GGUFModelRuntime_addSystemPrompt(
     env->ReleaseStringUTFChars(prompt, promptCstr);
 }
 
+// Set the system prompt without adding a chat message (primes the prefix cache lazily)
+extern "C" JNIEXPORT void JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_setSystemPrompt(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jstring prompt
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    if (!llm) return;
+
+    const char* promptCstr = env->GetStringUTFChars(prompt, nullptr);
+    llm->setSystemPrompt(promptCstr);
+    env->ReleaseStringUTFChars(prompt, promptCstr);
+}
+
 extern "C" JNIEXPORT void JNICALL
 Java_com_rapo_haloai_data_model_GGUFModelRuntime_addUserMessage(
     JNIEnv* env,
@@ -150,23 +325,119 @@ Java_com_rapo_haloai_data_model_GGUFModelRuntime_addAssistantMessage(
     env->ReleaseStringUTFChars(message, messageCstr);
 }
 
+// Read a Kotlin SamplingConfig into SamplerParams; seed < 0 means random
+static bool samplerParams(JNIEnv* env, jobject config, SamplerParams& params) {
+    if (!config) return false;
+
+    jclass configClass = env->GetObjectClass(config);
+    jfieldID temperature = env->GetFieldID(configClass, "temperature", "F");
+    jfieldID topK = env->GetFieldID(configClass, "topK", "I");
+    jfieldID topP = env->GetFieldID(configClass, "topP", "F");
+    jfieldID minP = env->GetFieldID(configClass, "minP", "F");
+    jfieldID repeatPenalty = env->GetFieldID(configClass, "repeatPenalty", "F");
+    jfieldID frequencyPenalty = env->GetFieldID(configClass, "frequencyPenalty", "F");
+    jfieldID presencePenalty = env->GetFieldID(configClass, "presencePenalty", "F");
+    jfieldID seed = env->GetFieldID(configClass, "seed", "I");
+    jfieldID grammar = env->GetFieldID(configClass, "grammar", "Ljava/lang/String;");
+    jfieldID jsonSchema = env->GetFieldID(configClass, "jsonSchema", "Ljava/lang/String;");
+    env->DeleteLocalRef(configClass);
+    if (!temperature || !topK || !topP || !minP || !repeatPenalty || !frequencyPenalty ||
+        !presencePenalty || !seed || !grammar || !jsonSchema) {
+        env->ExceptionClear();
+        LOGE("SamplingConfig fields not found");
+        return false;
+    }
+
+    params.temperature = env->GetFloatField(config, temperature);
+    params.topK = env->GetIntField(config, topK);
+    params.topP = env->GetFloatField(config, topP);
+    params.minP = env->GetFloatField(config, minP);
+    params.repeatPenalty = env->GetFloatField(config, repeatPenalty);
+    params.frequencyPenalty = env->GetFloatField(config, frequencyPenalty);
+    params.presencePenalty = env->GetFloatField(config, presencePenalty);
+    jint seedValue = env->GetIntField(config, seed);
+    params.seed = seedValue < 0 ? LLAMA_DEFAULT_SEED : (uint32_t)seedValue;
+
+    // A JSON schema takes precedence over a raw GBNF grammar
+    auto jsonSchemaStr = static_cast<jstring>(env->GetObjectField(config, jsonSchema));
+    auto grammarStr = static_cast<jstring>(env->GetObjectField(config, grammar));
+    jstring source = jsonSchemaStr ? jsonSchemaStr : grammarStr;
+    if (source) {
+        const char* chars = env->GetStringUTFChars(source, nullptr);
+        params.grammar = chars;
+        params.jsonSchema = source == jsonSchemaStr;
+        env->ReleaseStringUTFChars(source, chars);
+    }
+    if (jsonSchemaStr) env->DeleteLocalRef(jsonSchemaStr);
+    if (grammarStr) env->DeleteLocalRef(grammarStr);
+    return true;
+}
+
+// Wrap an optional PrefillProgressListener; only valid during the calling JNI call
+static PrefillCallback prefillCallback(JNIEnv* env, jobject progressListener) {
+    if (!progressListener) return nullptr;
+
+    jclass listenerClass = env->GetObjectClass(progressListener);
+    jmethodID onProgressMethod = env->GetMethodID(listenerClass, "onProgress", "(II)Z");
+    env->DeleteLocalRef(listenerClass);
+    if (!onProgressMethod) return nullptr;
+
+    return [env, progressListener, onProgressMethod](int processed, int total) {
+        jboolean keepGoing = env->CallBooleanMethod(progressListener, onProgressMethod, processed, total);
+        if (env->ExceptionCheck()) {
+            env->ExceptionClear();
+            return false;
+        }
+        return keepGoing == JNI_TRUE;
+    };
+}
+
+static std::vector<std::string> stringList(JNIEnv* env, jobjectArray array) {
+    std::vector<std::string> strings;
+    if (!array) return strings;
+    jsize count = env->GetArrayLength(array);
+    for (jsize i = 0; i < count; ++i) {
+        auto element = (jstring)env->GetObjectArrayElement(array, i);
+        if (!element) continue;
+        const char* chars = env->GetStringUTFChars(element, nullptr);
+        strings.emplace_back(chars);
+        env->ReleaseStringUTFChars(element, chars);
+        env->DeleteLocalRef(element);
+    }
+    return strings;
+}
+
 // Start completion (prepare prompt)
+// progressListener may be null; otherwise it receives onProgress(processed, total)
+// after each prefill chunk and can return false to cancel. stopSequences may be null.
 extern "C" JNIEXPORT void JNICALL
 Java_com_rapo_haloai_data_model_GGUFModelRuntime_startCompletion(
     JNIEnv* env,
     jobject /* this */,
     jlong handle,
-    jstring prompt
+    jstring prompt,
+    jobject samplingConfig,
+    jobjectArray stopSequences,
+    jobject progressListener
 ) {
     auto* llm = reinterpret_cast<LLMInference*>(handle);
     if (!llm) return;
 
+    PrefillCallback onProgress = prefillCallback(env, progressListener);
+    SamplerParams sampling;
+    bool hasSampling = samplerParams(env, samplingConfig, sampling);
+    std::vector<std::string> stop = stringList(env, stopSequences);
     const char* promptCstr = env->GetStringUTFChars(prompt, nullptr);
 
     try {
-        if (!llm->startCompletion(promptCstr)) {
-            env->ThrowNew(env->FindClass("java/lang/IllegalStateException"),
-                         "Failed to start completion");
+        if (!llm->startCompletion(promptCstr, onProgress, hasSampling ? &sampling : nullptr, stop)) {
+            if (llm->wasPrefillCancelled()) {
+                env->ThrowNew(env->FindClass("java/util/concurrent/CancellationException"),
+                             "Prefill cancelled");
+            } else {
+                env->ThrowNew(env->FindClass("java/lang/IllegalStateException"),
+                             "Failed to start completion");
+            }
         }
     } catch (std::runtime_error& error) {
         env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
@@ -175,6 +446,19 @@ Java_com_rapo_haloai_data_model_GGUFModelRuntime_startCompletion(
     env->ReleaseStringUTFChars(prompt, promptCstr);
 }
 
+extern "C" JNIEXPORT void JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_setPrefillChunkSize(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jint tokens
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    if (llm) {
+        llm->setPrefillChunkSize(tokens);
+    }
+}
+
 // Generate one token (call in loop from Kotlin)
 extern "C" JNIEXPORT jstring JNICALL
 Java_com_rapo_haloai_data_model_GGUFModelRuntime_completionLoop(
@@ -187,13 +471,298 @@ Java_com_rapo_haloai_data_model_GGUFModelRuntime_completionLoop(
 
     try {
         std::string piece = llm->completionLoop();
-        return env->NewStringUTF(piece.c_str());
+        return toJString(env, piece);
     } catch (std::runtime_error& error) {
         env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
         return nullptr;
     }
 }
 
+// Run the decode loop on a native thread after startCompletion, delivering text in
+// batches to listener.onText(String): Boolean and finishing with
+// listener.onComplete(tokenCount, error). Returns immediately.
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_startGeneration(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jint maxTokens,
+    jint flushTokens,
+    jint flushIntervalMs,
+    jobject listener
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    if (!llm || !listener) return JNI_FALSE;
+
+    JavaVM* vm = nullptr;
+    if (env->GetJavaVM(&vm) != JNI_OK) return JNI_FALSE;
+
+    jclass listenerClass = env->GetObjectClass(listener);
+    jmethodID onTextMethod = env->GetMethodID(listenerClass, "onText", "(Ljava/lang/String;)Z");
+    jmethodID onCompleteMethod = env->GetMethodID(listenerClass, "onComplete", "(ILjava/lang/String;)V");
+    env->DeleteLocalRef(listenerClass);
+    if (!onTextMethod || !onCompleteMethod) {
+        LOGE("GenerationListener methods not found");
+        return JNI_FALSE;
+    }
+
+    jobject listenerRef = env->NewGlobalRef(listener);
+    GenerationOptions options;
+    options.maxTokens = maxTokens;
+    options.flushTokens = flushTokens;
+    options.flushIntervalMs = flushIntervalMs;
+
+    llm->runInBackground([vm, llm, listenerRef, onTextMethod, onCompleteMethod, options]() {
+        JNIEnv* threadEnv = nullptr;
+        if (vm->AttachCurrentThread(&threadEnv, nullptr) != JNI_OK) {
+            LOGE("Failed to attach generation thread");
+            return;
+        }
+
+        int numTokens = llm->generate(options, [threadEnv, listenerRef, onTextMethod](const std::string& text) {
+            jstring jtext = toJString(threadEnv, text);
+            jboolean keepGoing = threadEnv->CallBooleanMethod(listenerRef, onTextMethod, jtext);
+            threadEnv->DeleteLocalRef(jtext);
+            if (threadEnv->ExceptionCheck()) {
+                threadEnv->ExceptionClear();
+                return false;
+            }
+            return keepGoing == JNI_TRUE;
+        });
+        llm->stopCompletion();
+
+        jstring error = numTokens < 0 ? threadEnv->NewStringUTF("Generation error") : nullptr;
+        threadEnv->CallVoidMethod(listenerRef, onCompleteMethod, numTokens < 0 ? 0 : numTokens, error);
+        if (threadEnv->ExceptionCheck()) {
+            threadEnv->ExceptionClear();
+        }
+        if (error) {
+            threadEnv->DeleteLocalRef(error);
+        }
+
+        threadEnv->DeleteGlobalRef(listenerRef);
+        vm->DetachCurrentThread();
+    });
+
+    return JNI_TRUE;
+}
+
+// JNIEnv for the calling native thread, attaching it on first use. Threads
+// attached here (e.g. the batch scheduler) are detached when they exit.
+static JavaVM* gVm = nullptr;
+static pthread_key_t gEnvKey;
+static pthread_once_t gEnvKeyOnce = PTHREAD_ONCE_INIT;
+
+static JNIEnv* attachedEnv(JavaVM* vm) {
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) == JNI_OK) {
+        return env;
+    }
+    if (vm->AttachCurrentThread(&env, nullptr) != JNI_OK) {
+        return nullptr;
+    }
+    gVm = vm;
+    pthread_once(&gEnvKeyOnce, []() {
+        pthread_key_create(&gEnvKey, [](void*) { gVm->DetachCurrentThread(); });
+    });
+    pthread_setspecific(gEnvKey, env);
+    return env;
+}
+
+// Run a side conversation on its own sequence, batched with the chat's decode
+// steps. Streams each piece to listener.onText(String): Boolean and ends with
+// listener.onComplete(tokenCount, null). Returns the session ID or -1.
+extern "C" JNIEXPORT jint JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_openSession(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jstring prompt,
+    jint maxTokens,
+    jobject listener
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    if (!llm || !listener) return -1;
+
+    JavaVM* vm = nullptr;
+    if (env->GetJavaVM(&vm) != JNI_OK) return -1;
+
+    jclass listenerClass = env->GetObjectClass(listener);
+    jmethodID onTextMethod = env->GetMethodID(listenerClass, "onText", "(Ljava/lang/String;)Z");
+    jmethodID onCompleteMethod = env->GetMethodID(listenerClass, "onComplete", "(ILjava/lang/String;)V");
+    env->DeleteLocalRef(listenerClass);
+    if (!onTextMethod || !onCompleteMethod) {
+        LOGE("GenerationListener methods not found");
+        return -1;
+    }
+
+    jobject listenerRef = env->NewGlobalRef(listener);
+    const char* promptStr = env->GetStringUTFChars(prompt, nullptr);
+    int tokenCount = 0;
+    int sessionId = llm->openSession(promptStr, maxTokens,
+        [vm, listenerRef, onTextMethod, onCompleteMethod, tokenCount](int, const std::string& piece, bool finished) mutable {
+            JNIEnv* threadEnv = attachedEnv(vm);
+            if (!threadEnv) {
+                LOGE("Failed to attach session callback thread");
+                return false;
+            }
+
+            if (finished) {
+                threadEnv->CallVoidMethod(listenerRef, onCompleteMethod, tokenCount, nullptr);
+                if (threadEnv->ExceptionCheck()) {
+                    threadEnv->ExceptionClear();
+                }
+                threadEnv->DeleteGlobalRef(listenerRef);
+                return false;
+            }
+
+            tokenCount++;
+            jstring jtext = toJString(threadEnv, piece);
+            jboolean keepGoing = threadEnv->CallBooleanMethod(listenerRef, onTextMethod, jtext);
+            threadEnv->DeleteLocalRef(jtext);
+            if (threadEnv->ExceptionCheck()) {
+                threadEnv->ExceptionClear();
+                return false;
+            }
+            return keepGoing == JNI_TRUE;
+        });
+    env->ReleaseStringUTFChars(prompt, promptStr);
+
+    if (sessionId < 0) {
+        env->DeleteGlobalRef(listenerRef);
+    }
+    return sessionId;
+}
+
+// Prefill once and decode n alternative responses in shared batches. Each
+// candidate streams to listener.onText(candidateId, String): Boolean and ends
+// with listener.onComplete(candidateId, tokenCount). Returns the candidate IDs.
+extern "C" JNIEXPORT jintArray JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_startCandidates(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jstring prompt,
+    jint n,
+    jint maxTokens,
+    jobject samplingConfig,
+    jobject progressListener,
+    jobject listener
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    if (!llm || !listener || n <= 0) return env->NewIntArray(0);
+
+    JavaVM* vm = nullptr;
+    if (env->GetJavaVM(&vm) != JNI_OK) return env->NewIntArray(0);
+
+    jclass listenerClass = env->GetObjectClass(listener);
+    jmethodID onTextMethod = env->GetMethodID(listenerClass, "onText", "(ILjava/lang/String;)Z");
+    jmethodID onCompleteMethod = env->GetMethodID(listenerClass, "onComplete", "(II)V");
+    env->DeleteLocalRef(listenerClass);
+    if (!onTextMethod || !onCompleteMethod) {
+        LOGE("CandidateListener methods not found");
+        return env->NewIntArray(0);
+    }
+
+    // One listener shared by all candidates; released when the last one finishes.
+    // Session callbacks are delivered one at a time, so the counts need no lock.
+    struct Shared {
+        jobject listenerRef;
+        std::atomic<int> remaining;
+        std::unordered_map<int, int> tokenCounts;  // Per candidate (session) ID
+    };
+    auto shared = std::make_shared<Shared>();
+    shared->listenerRef = env->NewGlobalRef(listener);
+    shared->remaining.store(n);
+
+    SessionCallback onText = [vm, shared, onTextMethod, onCompleteMethod](int id, const std::string& piece, bool finished) {
+        JNIEnv* threadEnv = attachedEnv(vm);
+        if (!threadEnv) {
+            LOGE("Failed to attach candidate callback thread");
+            return false;
+        }
+        if (finished) {
+            threadEnv->CallVoidMethod(shared->listenerRef, onCompleteMethod, id, shared->tokenCounts[id]);
+            if (threadEnv->ExceptionCheck()) {
+                threadEnv->ExceptionClear();
+            }
+            if (shared->remaining.fetch_sub(1) == 1) {
+                threadEnv->DeleteGlobalRef(shared->listenerRef);
+            }
+            return false;
+        }
+
+        shared->tokenCounts[id]++;
+        jstring jtext = toJString(threadEnv, piece);
+        jboolean keepGoing = threadEnv->CallBooleanMethod(shared->listenerRef, onTextMethod, id, jtext);
+        threadEnv->DeleteLocalRef(jtext);
+        if (threadEnv->ExceptionCheck()) {
+            threadEnv->ExceptionClear();
+            return false;
+        }
+        return keepGoing == JNI_TRUE;
+    };
+
+    SamplerParams sampling;
+    bool hasSampling = samplerParams(env, samplingConfig, sampling);
+    const char* promptCstr = env->GetStringUTFChars(prompt, nullptr);
+    std::vector<int> ids = llm->startCandidates(promptCstr, n, maxTokens,
+                                                prefillCallback(env, progressListener), onText,
+                                                hasSampling ? &sampling : nullptr);
+    env->ReleaseStringUTFChars(prompt, promptCstr);
+
+    // Candidates that were never created will not report back
+    int missing = n - (int)ids.size();
+    if (missing > 0 && shared->remaining.fetch_sub(missing) == missing) {
+        env->DeleteGlobalRef(shared->listenerRef);
+    }
+
+    if (ids.empty() && llm->wasPrefillCancelled()) {
+        env->ThrowNew(env->FindClass("java/util/concurrent/CancellationException"), "Prefill cancelled");
+        return nullptr;
+    }
+
+    jintArray result = env->NewIntArray((jsize)ids.size());
+    env->SetIntArrayRegion(result, 0, (jsize)ids.size(), ids.data());
+    return result;
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_closeSession(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jint sessionId
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    if (llm) {
+        llm->closeSession(sessionId);
+    }
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_getActiveSessionCount(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    return llm ? llm->getActiveSessionCount() : 0;
+}
+
+// Request cancellation of the running prefill/generation (safe from any thread)
+extern "C" JNIEXPORT void JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_cancelCompletion(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    if (llm) {
+        llm->requestCancel();
+    }
+}
+
 // Stop completion (finalize)
 extern "C" JNIEXPORT void JNICALL
 Java_com_rapo_haloai_data_model_GGUFModelRuntime_stopCompletion(
@@ -207,6 +776,62 @@ Java_com_rapo_haloai_data_model_GGUFModelRuntime_stopCompletion(
     llm->stopCompletion();
 }
 
+// Save the current conversation's KV state, then trim the snapshot directory
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_saveSession(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jstring path,
+    jlong maxDirBytes
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    if (!llm) return JNI_FALSE;
+
+    const char* pathCstr = env->GetStringUTFChars(path, nullptr);
+    bool saved = llm->saveSession(pathCstr);
+    if (saved) {
+        SessionStore::prune(SessionStore::parentDir(pathCstr), maxDirBytes);
+    }
+    env->ReleaseStringUTFChars(path, pathCstr);
+
+    return saved ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_loadSession(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jstring path
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    if (!llm) return JNI_FALSE;
+
+    const char* pathCstr = env->GetStringUTFChars(path, nullptr);
+    bool loaded = llm->loadSession(pathCstr);
+    env->ReleaseStringUTFChars(path, pathCstr);
+
+    return loaded ? JNI_TRUE : JNI_FALSE;
+}
+
+// Overflow policy: shift the context (keeping keepTokens, dropping discardTokens per shift)
+// or fail when the prompt does not fit. Negative keepTokens keeps the system prefix.
+extern "C" JNIEXPORT void JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_setContextShift(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jboolean enabled,
+    jint keepTokens,
+    jint discardTokens
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    if (llm) {
+        llm->setContextShift(enabled == JNI_TRUE, keepTokens, discardTokens);
+    }
+}
+
 // Get generation metrics
 extern "C" JNIEXPORT jfloat JNICALL
 Java_com_rapo_haloai_data_model_GGUFModelRuntime_getResponseGenerationSpeed(
@@ -218,6 +843,81 @@ Java_com_rapo_haloai_data_model_GGUFModelRuntime_getResponseGenerationSpeed(
     return llm ? llm->getResponseGenerationTime() : 0.0f;
 }
 
+extern "C" JNIEXPORT jint JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_getResponseNumTokens(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    return llm ? llm->getResponseNumTokens() : 0;
+}
+
+// Speculative decoding stats: [acceptance rate, effective tok/s, drafted, accepted]
+extern "C" JNIEXPORT jfloatArray JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_getSpeculativeStats(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    jfloat values[4] = {
+        llm ? llm->getDraftAcceptanceRate() : 0.0f,
+        llm ? llm->getEffectiveTokensPerSecond() : 0.0f,
+        llm ? (jfloat)llm->getDraftedTokens() : 0.0f,
+        llm ? (jfloat)llm->getAcceptedDraftTokens() : 0.0f
+    };
+
+    jfloatArray result = env->NewFloatArray(4);
+    env->SetFloatArrayRegion(result, 0, 4, values);
+    return result;
+}
+
+// Per-phase performance metrics as one InferenceMetrics object
+extern "C" JNIEXPORT jobject JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_getInferenceMetrics(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    PerfMetrics metrics = llm ? llm->getPerfMetrics() : PerfMetrics();
+
+    jclass metricsClass = env->FindClass("com/rapo/haloai/data/model/InferenceMetrics");
+    if (!metricsClass) {
+        LOGE("Failed to find InferenceMetrics class");
+        return nullptr;
+    }
+
+    jmethodID constructor = env->GetMethodID(metricsClass, "<init>", "(FFFIFFIFFFFFFJ)V");
+    if (!constructor) {
+        LOGE("Failed to find InferenceMetrics constructor");
+        return nullptr;
+    }
+
+    jobject metricsObj = env->NewObject(
+        metricsClass,
+        constructor,
+        metrics.loadMs,
+        metrics.pageInMs,
+        metrics.warmupMs,
+        metrics.prefillTokens,
+        metrics.prefillMs,
+        metrics.ttftMs,
+        metrics.decodeTokens,
+        metrics.decodeMs,
+        metrics.decodeP50Ms,
+        metrics.decodeP95Ms,
+        metrics.decodeP99Ms,
+        metrics.sampleMs,
+        metrics.detokenizeMs,
+        (jlong)metrics.peakRssKb
+    );
+
+    env->DeleteLocalRef(metricsClass);
+    return metricsObj;
+}
+
 extern "C" JNIEXPORT jint JNICALL
 Java_com_rapo_haloai_data_model_GGUFModelRuntime_getContextSizeUsed(
     JNIEnv* env,
@@ -228,6 +928,26 @@ Java_com_rapo_haloai_data_model_GGUFModelRuntime_getContextSizeUsed(
     return llm ? llm->getContextSizeUsed() : 0;
 }
 
+extern "C" JNIEXPORT jint JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_getPromptTokensReused(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    return llm ? llm->getPromptTokensReused() : 0;
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_getPromptTokensDecoded(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    return llm ? llm->getPromptTokensDecoded() : 0;
+}
+
 extern "C" JNIEXPORT void JNICALL
 Java_com_rapo_haloai_data_model_GGUFModelRuntime_clearMessages(
     JNIEnv* env,
@@ -265,7 +985,25 @@ Java_com_rapo_haloai_data_model_GGUFModelRuntime_getModelInfo(
     }
 
     std::string info = llm->getModelInfo();
-    return env->NewStringUTF(info.c_str());
+    return toJString(env, info);
+}
+
+// Memory footprint: [model weights bytes, KV cache bytes]
+extern "C" JNIEXPORT jlongArray JNICALL
+Java_com_rapo_haloai_data_model_GGUFModelRuntime_getMemoryFootprint(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle
+) {
+    auto* llm = reinterpret_cast<LLMInference*>(handle);
+    jlong values[2] = {
+        llm ? (jlong)llm->getModelSizeBytes() : 0,
+        llm ? (jlong)llm->getKvCacheBytes() : 0
+    };
+
+    jlongArray result = env->NewLongArray(2);
+    env->SetLongArrayRegion(result, 0, 2, values);
+    return result;
 }
 
 extern "C" JNIEXPORT void JNICALL
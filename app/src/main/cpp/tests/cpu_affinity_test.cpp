@@ -0,0 +1,172 @@
+// Host test for CpuAffinity::detect against fake sysfs trees laid out like
+// /sys/devices/system/cpu: big.LITTLE, uniform and without cpufreq.
+
+#include "CpuAffinity.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+    do {                                                              \
+        if (!(cond)) {                                                \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
+
+// Temporary directory tree, removed when the test ends
+class FakeSysfs {
+public:
+    FakeSysfs() {
+        char tmpl[] = "/tmp/haloai_sysfs_XXXXXX";
+        const char* dir = mkdtemp(tmpl);
+        _root = dir ? dir : "";
+    }
+    ~FakeSysfs() {
+        if (!_root.empty()) {
+            std::string cmd = "rm -rf '" + _root + "'";
+            if (system(cmd.c_str()) != 0) {
+                fprintf(stderr, "Failed to remove %s\n", _root.c_str());
+            }
+        }
+    }
+
+    const std::string& root() const { return _root; }
+
+    void write(const std::string& path, const std::string& text) {
+        std::string full = _root;
+        size_t start = 0;
+        // Create parent directories
+        while (true) {
+            size_t slash = path.find('/', start);
+            if (slash == std::string::npos) break;
+            mkdir((full + "/" + path.substr(0, slash)).c_str(), 0755);
+            start = slash + 1;
+        }
+        FILE* file = fopen((full + "/" + path).c_str(), "w");
+        if (!file) {
+            fprintf(stderr, "Failed to write %s\n", path.c_str());
+            failures++;
+            return;
+        }
+        fputs(text.c_str(), file);
+        fclose(file);
+    }
+
+    // One core's cpu_capacity and cpuinfo_max_freq; 0 leaves the file out
+    void core(int id, int capacity, uint64_t maxFreqKhz) {
+        std::string dir = "cpu" + std::to_string(id);
+        if (capacity > 0) write(dir + "/cpu_capacity", std::to_string(capacity) + "\n");
+        if (maxFreqKhz > 0) write(dir + "/cpufreq/cpuinfo_max_freq", std::to_string(maxFreqKhz) + "\n");
+    }
+
+private:
+    std::string _root;
+};
+
+static std::vector<int> ids(const CpuTopology& topology) {
+    std::vector<int> result;
+    for (const CpuCore& core : topology.cores) result.push_back(core.id);
+    return result;
+}
+
+// 4 little, 3 mid and 1 prime core, as on recent Snapdragon parts
+static void testBigLittle() {
+    FakeSysfs sysfs;
+    sysfs.write("online", "0-7\n");
+    for (int i = 0; i < 4; i++) sysfs.core(i, 400, 1800000);
+    for (int i = 4; i < 7; i++) sysfs.core(i, 750, 2500000);
+    sysfs.core(7, 1024, 3200000);
+
+    CpuTopology topology = CpuAffinity::detect(sysfs.root());
+    CHECK(topology.heterogeneous);
+    CHECK((ids(topology) == std::vector<int>{7, 4, 5, 6, 0, 1, 2, 3}));
+    CHECK(topology.performanceCores == 4);
+    CHECK(topology.prefillThreads == 4);
+    // Mid cores are below kDecodeSpeedRatio of the prime core
+    CHECK(topology.decodeThreads == 1);
+
+    CHECK((CpuAffinity::fastestCores(topology, 1) == std::vector<int>{7}));
+    CHECK((CpuAffinity::fastestCores(topology, 4) == std::vector<int>{7, 4, 5, 6}));
+    CHECK(CpuAffinity::fastestCores(topology, 5).empty());
+    CHECK(CpuAffinity::fastestCores(topology, 0).empty());
+}
+
+// Without cpu_capacity the cluster split comes from the maximum frequency
+static void testFrequencyOnly() {
+    FakeSysfs sysfs;
+    sysfs.write("online", "0-5\n");
+    for (int i = 0; i < 4; i++) sysfs.core(i, 0, 1800000);
+    for (int i = 4; i < 6; i++) sysfs.core(i, 0, 2400000);
+
+    CpuTopology topology = CpuAffinity::detect(sysfs.root());
+    CHECK(topology.heterogeneous);
+    CHECK(topology.performanceCores == 2);
+    CHECK(topology.prefillThreads == 2);
+    CHECK(topology.decodeThreads == 2);
+    CHECK((CpuAffinity::fastestCores(topology, 2) == std::vector<int>{4, 5}));
+}
+
+static void testUniform() {
+    FakeSysfs sysfs;
+    sysfs.write("online", "0-3\n");
+    for (int i = 0; i < 4; i++) sysfs.core(i, 1024, 2000000);
+
+    CpuTopology topology = CpuAffinity::detect(sysfs.root());
+    CHECK(!topology.heterogeneous);
+    CHECK(topology.performanceCores == 4);
+    CHECK(topology.decodeThreads == 2);
+    CHECK(topology.prefillThreads == 4);
+    CHECK(CpuAffinity::fastestCores(topology, 2).empty());
+}
+
+// No cpufreq or capacity at all (some emulators and containers): every core
+// looks the same, and "possible" stands in for a missing "online"
+static void testMissingCpufreq() {
+    FakeSysfs sysfs;
+    sysfs.write("possible", "0-5\n");
+
+    CpuTopology topology = CpuAffinity::detect(sysfs.root());
+    CHECK(!topology.heterogeneous);
+    CHECK((ids(topology) == std::vector<int>{0, 1, 2, 3, 4, 5}));
+    CHECK(topology.performanceCores == 6);
+    CHECK(topology.decodeThreads == 3);
+    CHECK(topology.prefillThreads == 6);
+    CHECK(CpuAffinity::fastestCores(topology, 1).empty());
+}
+
+// cpufreq on only some cores is not trusted for a split
+static void testPartialCpufreq() {
+    FakeSysfs sysfs;
+    sysfs.write("online", "0-3,6-7\n");
+    sysfs.core(0, 0, 1800000);
+    sysfs.core(1, 0, 1800000);
+    sysfs.core(6, 0, 3000000);
+
+    CpuTopology topology = CpuAffinity::detect(sysfs.root());
+    CHECK(!topology.heterogeneous);
+    CHECK((ids(topology) == std::vector<int>{0, 1, 2, 3, 6, 7}));
+    CHECK(topology.performanceCores == 6);
+    CHECK(topology.decodeThreads == 3);
+    CHECK(topology.prefillThreads == 6);
+}
+
+int main() {
+    testBigLittle();
+    testFrequencyOnly();
+    testUniform();
+    testMissingCpufreq();
+    testPartialCpufreq();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("cpu_affinity_test: all checks passed\n");
+    return 0;
+}
@@ -55,4 +55,7 @@ interface ChatDao {
     
     @Query("UPDATE chat_sessions SET lastMessageAt = :timestamp WHERE sessionId = :sessionId")
     suspend fun updateSessionTimestamp(sessionId: String, timestamp: Long)
+    
+    @Query("UPDATE chat_sessions SET title = :title WHERE sessionId = :sessionId")
+    suspend fun updateSessionTitle(sessionId: String, title: String)
 }
@@ -1,16 +1,30 @@
 package com.rapo.haloai.data.model
 
+import android.content.Context
 import android.util.Log
 import com.rapo.haloai.data.database.entities.ModelEntity
 import com.rapo.haloai.data.database.entities.ModelFormat
 import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.channels.Channel
+import kotlinx.coroutines.channels.awaitClose
 import kotlinx.coroutines.flow.Flow
+import kotlinx.coroutines.flow.MutableStateFlow
+import kotlinx.coroutines.flow.StateFlow
+import kotlinx.coroutines.flow.asStateFlow
+import kotlinx.coroutines.flow.buffer
 import kotlinx.coroutines.flow.callbackFlow
 import kotlinx.coroutines.flow.flowOn
+import kotlinx.coroutines.isActive
+import dagger.hilt.android.qualifiers.ApplicationContext
 import kotlinx.coroutines.withContext
+import java.io.File
+import java.util.concurrent.atomic.AtomicBoolean
+import java.util.concurrent.atomic.AtomicInteger
 import javax.inject.Inject
 
-class GGUFModelRuntime @Inject constructor() : ModelRuntime {
+class GGUFModelRuntime @Inject constructor(
+    @ApplicationContext private val context: Context
+) : ModelRuntime {
 
     private var isModelLoaded = false
     private var modelPath: String? = null
@@ -18,6 +32,45 @@ class GGUFModelRuntime @Inject constructor() : ModelRuntime {
     
     var threads: Int = 4
     var contextLength: Int = 1535
+    var temperature: Float = 0.8f
+    // Sampler chain for the next request; changing it does not reload the model
+    var sampling: SamplingConfig = SamplingConfig()
+    // Generation ends at the first of these; the stop string itself is not emitted
+    var stopSequences: List<String> = DEFAULT_STOP_SEQUENCES
+    // Chat whose history the native side holds; each response extends it, so it
+    // only needs rebuilding when this changes (null forces a rebuild)
+    var conversationId: String? = null
+    // Tokens per prefill decode; the native side caps it at the context batch size (512)
+    var prefillChunkSize: Int = 512
+    private val generationActive = AtomicBoolean(false)
+    var kvCacheType: KvCacheType = KvCacheType.F16
+    var flashAttention: Boolean = false
+    
+    // Page the weights in and run one dummy decode during load, so the first reply
+    // runs at steady-state speed; weights up to mlockMaxBytes are also locked in RAM
+    var warmup: Boolean = true
+    var mlockMaxBytes: Long = 0L
+    
+    // Optional draft model for speculative decoding (must share the main model's vocabulary)
+    var draftModelPath: String? = null
+    var draftTokens: Int = 4
+    
+    // Draft-free speculation from n-gram matches in the prompt/output (used when no draft model)
+    var promptLookup: Boolean = false
+    var promptLookupNgram: Int = 3
+    
+    // Retune decode threads from measured token latency (throttling, background load);
+    // results are kept per device and model in threadTuningFile
+    var threadAutoTune: Boolean = false
+    
+    // Slide the context window on overflow instead of failing; -1 keeps the system prompt
+    var contextShift: Boolean = true
+    var contextShiftKeep: Int = -1
+    var contextShiftDiscard: Int = 0
+    
+    // Fraction of the prompt prefilled so far (0 when idle)
+    private val _prefillProgress = MutableStateFlow(0f)
+    val prefillProgress: StateFlow<Float> = _prefillProgress.asStateFlow()
     
     // Expose metrics
     fun getGenerationSpeed(): Float {
@@ -26,21 +79,141 @@ class GGUFModelRuntime @Inject constructor() : ModelRuntime {
         } else 0f
     }
     
+    // Tokens generated for the last response (text arrives batched, so count natively)
+    fun getLastResponseTokenCount(): Int {
+        return if (isModelLoaded && modelHandle != 0L) {
+            getResponseNumTokens(modelHandle)
+        } else 0
+    }
+    
+    // Bytes used by model weights and the KV cache
+    fun getMemoryUsage(): Pair<Long, Long> {
+        return if (isModelLoaded && modelHandle != 0L) {
+            val footprint = getMemoryFootprint(modelHandle)
+            Pair(footprint[0], footprint[1])
+        } else Pair(0L, 0L)
+    }
+    
+    // Draft acceptance rate (0..1) and effective tokens/sec of the last response
+    fun getSpeculativeMetrics(): Pair<Float, Float> {
+        return if (isModelLoaded && modelHandle != 0L) {
+            val stats = getSpeculativeStats(modelHandle)
+            Pair(stats[0], stats[1])
+        } else Pair(0f, 0f)
+    }
+    
+    fun getDetailedMetrics(): InferenceMetrics? {
+        return if (isModelLoaded && modelHandle != 0L) {
+            getInferenceMetrics(modelHandle)
+        } else null
+    }
+    
     fun getContextUsage(): Int {
         return if (isModelLoaded && modelHandle != 0L) {
             getContextSizeUsed(modelHandle)
         } else 0
     }
 
+    // Prompt tokens served from the KV cache vs. decoded on the last turn
+    fun getPromptReuseStats(): Pair<Int, Int> {
+        return if (isModelLoaded && modelHandle != 0L) {
+            Pair(getPromptTokensReused(modelHandle), getPromptTokensDecoded(modelHandle))
+        } else Pair(0, 0)
+    }
+
+    // Reset to a new conversation; the system prompt KV is restored from the prefix cache
+    suspend fun startNewConversation(systemPrompt: String) = withContext(Dispatchers.IO) {
+        if (isModelLoaded && modelHandle != 0L) {
+            if (systemPrompt.isNotBlank()) {
+                setSystemPrompt(modelHandle, systemPrompt)
+            }
+            startFreshConversation(modelHandle)
+        }
+    }
+
+    // KV session snapshots live in the app cache, one file per chat session
+    private val sessionDir: File by lazy { File(context.cacheDir, "kv_sessions") }
+
+    private val threadTuningFile: File by lazy { File(context.filesDir, "thread_tuning.txt") }
+
+    private fun sessionFile(sessionId: String): File = File(sessionDir, "$sessionId.kv")
+
+    suspend fun saveSessionState(sessionId: String): Boolean = withContext(Dispatchers.IO) {
+        if (!isModelLoaded || modelHandle == 0L) return@withContext false
+        sessionDir.mkdirs()
+        saveSession(modelHandle, sessionFile(sessionId).path, MAX_SESSION_CACHE_BYTES)
+    }
+
+    suspend fun restoreSessionState(sessionId: String): Boolean = withContext(Dispatchers.IO) {
+        if (!isModelLoaded || modelHandle == 0L) return@withContext false
+        val file = sessionFile(sessionId)
+        file.exists() && loadSession(modelHandle, file.path)
+    }
+
+    suspend fun deleteSessionState(sessionId: String) = withContext(Dispatchers.IO) {
+        sessionFile(sessionId).delete()
+    }
+
     private external fun getModelMetadata(modelPath: String): ModelMetadata
-    private external fun initModel(modelPath: String, threads: Int, contextLength: Int): Long
+    private external fun planMemory(modelPath: String, budgetBytes: Long, contextLength: Int, kvCacheType: Int, flashAttention: Boolean): MemoryPlan?
+    private external fun initModel(
+        modelPath: String,
+        threads: Int,
+        contextLength: Int,
+        temperature: Float,
+        kvCacheType: Int,
+        flashAttention: Boolean,
+        warmup: Boolean,
+        mlockMaxBytes: Long
+    ): Long
+    private external fun getMemoryFootprint(handle: Long): LongArray
+    private external fun loadDraftModel(handle: Long, modelPath: String, nDraft: Int): Boolean
+    private external fun freeDraftModel(handle: Long)
+    private external fun setPromptLookup(handle: Long, enabled: Boolean, ngramMax: Int, nDraft: Int)
+    private external fun setThreadAutoTune(handle: Long, enabled: Boolean, statePath: String?)
+    private external fun getSpeculativeStats(handle: Long): FloatArray
     private external fun addChatMessage(handle: Long, message: String, role: String)
-    private external fun startCompletion(handle: Long, prompt: String)
-    private external fun completionLoop(handle: Long): String
+    private external fun startCompletion(
+        handle: Long,
+        prompt: String,
+        sampling: SamplingConfig?,
+        stopSequences: Array<String>?,
+        progressListener: PrefillProgressListener?
+    )
+    private external fun setPrefillChunkSize(handle: Long, tokens: Int)
+    private external fun setContextShift(handle: Long, enabled: Boolean, keepTokens: Int, discardTokens: Int)
+    private external fun startGeneration(
+        handle: Long,
+        maxTokens: Int,
+        flushTokens: Int,
+        flushIntervalMs: Int,
+        listener: GenerationListener
+    ): Boolean
+    private external fun openSession(handle: Long, prompt: String, maxTokens: Int, listener: GenerationListener): Int
+    private external fun closeSession(handle: Long, sessionId: Int)
+    private external fun startCandidates(
+        handle: Long,
+        prompt: String,
+        n: Int,
+        maxTokens: Int,
+        sampling: SamplingConfig?,
+        progressListener: PrefillProgressListener?,
+        listener: CandidateListener
+    ): IntArray
+    private external fun getActiveSessionCount(handle: Long): Int
+    private external fun getResponseNumTokens(handle: Long): Int
     private external fun stopCompletion(handle: Long)
+    private external fun cancelCompletion(handle: Long)
+    private external fun saveSession(handle: Long, path: String, maxDirBytes: Long): Boolean
+    private external fun loadSession(handle: Long, path: String): Boolean
     private external fun getResponseGenerationSpeed(handle: Long): Float
+    private external fun getInferenceMetrics(handle: Long): InferenceMetrics?
     private external fun getContextSizeUsed(handle: Long): Int
+    private external fun getPromptTokensReused(handle: Long): Int
+    private external fun getPromptTokensDecoded(handle: Long): Int
     private external fun clearMessages(handle: Long)
+    private external fun setSystemPrompt(handle: Long, prompt: String)
+    private external fun startFreshConversation(handle: Long)
     private external fun freeModel(handle: Long)
     
     // Public method to read model metadata before loading
@@ -48,6 +221,16 @@ class GGUFModelRuntime @Inject constructor() : ModelRuntime {
         return getModelMetadata(modelPath)
     }
 
+    // Largest context and KV cache type that fit budgetBytes (0: a share of free memory);
+    // contextLength AUTO and KvCacheType.AUTO are searched, anything else is kept
+    fun planMemory(
+        modelPath: String,
+        budgetBytes: Long = 0,
+        contextLength: Int = AUTO,
+        kvCacheType: KvCacheType = KvCacheType.AUTO,
+        flashAttention: Boolean = this.flashAttention
+    ): MemoryPlan? = planMemory(modelPath, budgetBytes, contextLength, kvCacheType.ordinal, flashAttention)
+
     // Public method to add chat message for conversation context
     fun addConversationMessage(message: String, role: String) {
         if (isModelLoaded && modelHandle != 0L) {
@@ -64,6 +247,16 @@ class GGUFModelRuntime @Inject constructor() : ModelRuntime {
 
     companion object {
         private const val TAG = "GGUFModelRuntime"
+        private const val MAX_SESSION_CACHE_BYTES = 512L * 1024 * 1024
+        private const val MB = 1024L * 1024
+        private const val STREAM_FLUSH_TOKENS = 8
+        private const val STREAM_FLUSH_INTERVAL_MS = 50
+        // threads/contextLength value that lets the native memory planner choose
+        const val AUTO = 0
+        // Turn markers models tend to run on into after their answer
+        val DEFAULT_STOP_SEQUENCES = listOf(
+            "\nUser:", "\n### User", "<|im_start|>user", "<|start_header_id|>user", "<|user|>"
+        )
         init {
             try {
                 System.loadLibrary("haloai_native")
@@ -100,9 +293,12 @@ class GGUFModelRuntime @Inject constructor() : ModelRuntime {
                 }
                 
                 Log.d(TAG, "File exists and readable, size: ${file.length()} bytes")
-                Log.d(TAG, "Calling native initModel with threads=$threads, context=$contextLength...")
+                Log.d(TAG, "Calling native initModel with threads=$threads, context=$contextLength, kv=$kvCacheType, flashAttention=$flashAttention...")
                 
-                modelHandle = initModel(model.path, threads, contextLength)
+                modelHandle = initModel(
+                    model.path, threads, contextLength, temperature, kvCacheType.ordinal, flashAttention,
+                    warmup, mlockMaxBytes
+                )
                 
                 Log.d(TAG, "Native initModel returned handle: $modelHandle")
                 
@@ -111,9 +307,23 @@ class GGUFModelRuntime @Inject constructor() : ModelRuntime {
                     return@withContext Result.failure(RuntimeException("Failed to initialize GGUF model - check native logs"))
                 }
                 
+                setPrefillChunkSize(modelHandle, prefillChunkSize)
+                setContextShift(modelHandle, contextShift, contextShiftKeep, contextShiftDiscard)
+                setPromptLookup(modelHandle, promptLookup, promptLookupNgram, draftTokens)
+                setThreadAutoTune(modelHandle, threadAutoTune, threadTuningFile.path)
+                draftModelPath?.let { draftPath ->
+                    if (!loadDraftModel(modelHandle, draftPath, draftTokens)) {
+                        Log.w(TAG, "Draft model not usable, continuing without speculative decoding")
+                    }
+                }
                 modelPath = model.path
                 isModelLoaded = true
-                Log.d(TAG, "Model initialized successfully")
+                conversationId = null
+                val footprint = getMemoryFootprint(modelHandle)
+                Log.d(TAG, "Model initialized successfully (weights ${footprint[0] / MB} MB, KV cache ${footprint[1] / MB} MB)")
+                getInferenceMetrics(modelHandle)?.takeIf { it.warmupMs > 0f }?.let { m ->
+                    Log.d(TAG, "Warm-up decode took ${m.warmupMs} ms")
+                }
                 Result.success(Unit)
             } catch (e: Exception) {
                 Log.e(TAG, "Exception in initializeModel", e)
@@ -124,6 +334,9 @@ class GGUFModelRuntime @Inject constructor() : ModelRuntime {
 
     override fun generateResponse(prompt: String, maxTokens: Int): Flow<String> {
         return callbackFlow {
+            val finished = AtomicBoolean(false)
+            // From here a stop request is held natively until this turn consumes it
+            generationActive.set(true)
             try {
                 Log.d(TAG, "generateResponse called")
                 
@@ -132,59 +345,144 @@ class GGUFModelRuntime @Inject constructor() : ModelRuntime {
                     throw IllegalStateException("Model not initialized")
                 }
                 
-                // Start completion
-                startCompletion(modelHandle, prompt)
-                Log.d(TAG, "Completion started")
-                
-                var tokenCount = 0
+                // Start completion; prefill runs in chunks and stops early if the collector goes away
+                startCompletion(modelHandle, prompt, sampling, stopSequences.toTypedArray()) { processed, total ->
+                    _prefillProgress.value = processed.toFloat() / total
+                    isActive
+                }
+                _prefillProgress.value = 0f
+                Log.d(TAG, "Completion started (prompt tokens reused=${getPromptTokensReused(modelHandle)}, decoded=${getPromptTokensDecoded(modelHandle)})")
                 
-                // Generation loop - call completionLoop until EOS
-                while (tokenCount < maxTokens) {
-                    val piece = completionLoop(modelHandle)
-                    
-                    // Check for special markers
-                    when (piece) {
-                        "[EOG]" -> {
-                            Log.d(TAG, "End of generation at $tokenCount tokens")
-                            break
-                        }
-                        "[ERROR]" -> {
-                            Log.e(TAG, "Generation error")
-                            throw IllegalStateException("Generation error")
-                        }
-                        else -> {
-                            if (piece.isNotEmpty()) {
-                                trySend(piece).isSuccess
+                // Decode runs on a native thread and hands text over in batches
+                val started = startGeneration(
+                    modelHandle, maxTokens, STREAM_FLUSH_TOKENS, STREAM_FLUSH_INTERVAL_MS,
+                    object : GenerationListener {
+                        override fun onText(text: String): Boolean = trySend(text).isSuccess
+
+                        override fun onComplete(tokenCount: Int, error: String?) {
+                            finished.set(true)
+                            generationActive.set(false)
+                            val speed = getResponseGenerationSpeed(modelHandle)
+                            val contextUsed = getContextSizeUsed(modelHandle)
+                            val (acceptance, effectiveSpeed) = getSpeculativeMetrics()
+                            getInferenceMetrics(modelHandle)?.let { m ->
+                                Log.d(TAG, "Prefill ${m.prefillTokens} tok in ${m.prefillMs} ms, TTFT ${m.timeToFirstTokenMs} ms, " +
+                                    "decode p50/p95/p99 ${m.decodeP50Ms}/${m.decodeP95Ms}/${m.decodeP99Ms} ms, " +
+                                    "sample ${m.sampleMs} ms, detokenize ${m.detokenizeMs} ms, peak RSS ${m.peakRssKb / 1024} MB")
                             }
+                            Log.d(TAG, "Generation complete: $tokenCount tokens, $speed tok/s, context: $contextUsed" +
+                                if (draftModelPath != null || promptLookup) ", draft acceptance ${acceptance * 100}%, effective $effectiveSpeed tok/s" else "")
+                            if (error != null) close(IllegalStateException(error)) else close()
                         }
                     }
-                    
-                    tokenCount++
-                    
-                    if (tokenCount % 20 == 0) {
-                        Log.d(TAG, "Generated $tokenCount tokens so far")
-                    }
+                )
+                if (!started) {
+                    throw IllegalStateException("Failed to start generation")
                 }
-                
-                // Stop completion
-                stopCompletion(modelHandle)
-                
-                val speed = getResponseGenerationSpeed(modelHandle)
-                val contextUsed = getContextSizeUsed(modelHandle)
-                Log.d(TAG, "Generation complete: $tokenCount tokens, $speed tok/s, context: $contextUsed")
-                
-                close()
             } catch (e: Exception) {
+                finished.set(true)
+                generationActive.set(false)
+                _prefillProgress.value = 0f
                 Log.e(TAG, "Error in generateResponse", e)
                 try {
                     stopCompletion(modelHandle)
                 } catch (ignored: Exception) {}
                 close(e)
             }
-        }.flowOn(Dispatchers.Default)
+
+            // Collector went away before the native loop finished: stop it
+            awaitClose {
+                if (!finished.get()) {
+                    cancelCompletion(modelHandle)
+                }
+            }
+        }.buffer(Channel.UNLIMITED).flowOn(Dispatchers.Default)
+    }
+
+    /**
+     * Runs a side conversation (e.g. summarizing a chat) on its own sequence in the loaded
+     * context. Its decode steps share a single batched decode with the foreground chat,
+     * so both make progress without loading the model twice.
+     */
+    fun runBatchedSession(prompt: String, maxTokens: Int = 256): Flow<String> {
+        return callbackFlow {
+            if (!isModelLoaded || modelHandle == 0L) {
+                throw IllegalStateException("Model not initialized")
+            }
+
+            val finished = AtomicBoolean(false)
+            val sessionId = openSession(modelHandle, prompt, maxTokens, object : GenerationListener {
+                override fun onText(text: String): Boolean = trySend(text).isSuccess
+
+                override fun onComplete(tokenCount: Int, error: String?) {
+                    finished.set(true)
+                    Log.d(TAG, "Batched session complete: $tokenCount tokens")
+                    close()
+                }
+            })
+            if (sessionId < 0) {
+                throw IllegalStateException("No free session slot")
+            }
+
+            awaitClose {
+                if (!finished.get()) {
+                    closeSession(modelHandle, sessionId)
+                }
+            }
+        }.buffer(Channel.UNLIMITED).flowOn(Dispatchers.Default)
+    }
+
+    /**
+     * Produces [count] alternative responses to one prompt: the prompt is prefilled once,
+     * its KV cache is forked per candidate and all candidates decode in a shared batch.
+     * Chunks of every candidate are interleaved in the flow, tagged with the candidate ID.
+     */
+    fun generateCandidates(prompt: String, count: Int, maxTokens: Int): Flow<CandidateChunk> {
+        return callbackFlow {
+            if (!isModelLoaded || modelHandle == 0L) {
+                throw IllegalStateException("Model not initialized")
+            }
+
+            val pending = AtomicInteger(count)
+            val ids = startCandidates(modelHandle, prompt, count, maxTokens, sampling,
+                { processed, total ->
+                    _prefillProgress.value = processed.toFloat() / total
+                    isActive
+                },
+                object : CandidateListener {
+                    override fun onText(candidateId: Int, text: String): Boolean =
+                        trySend(CandidateChunk(candidateId, text)).isSuccess
+
+                    override fun onComplete(candidateId: Int, tokenCount: Int) {
+                        Log.d(TAG, "Candidate $candidateId complete: $tokenCount tokens")
+                        if (pending.decrementAndGet() == 0) close()
+                    }
+                }
+            )
+            _prefillProgress.value = 0f
+            if (ids.isEmpty()) {
+                throw IllegalStateException("Failed to start candidates")
+            }
+            // Candidates that could not be forked will never complete
+            if (pending.addAndGet(ids.size - count) == 0) close()
+
+            awaitClose {
+                ids.forEach { closeSession(modelHandle, it) }
+            }
+        }.buffer(Channel.UNLIMITED).flowOn(Dispatchers.Default)
+    }
+
+    fun getActiveSessionCount(): Int {
+        return if (isModelLoaded && modelHandle != 0L) getActiveSessionCount(modelHandle) else 0
     }
 
-    override suspend fun stopGeneration() { /* No-op */ }
+    // Sets the native cancel flag; the running decode aborts and the loop ends within one step.
+    // Skipped when nothing is generating, as the flag would otherwise stop the next response.
+    override suspend fun stopGeneration() {
+        if (isModelLoaded && modelHandle != 0L && generationActive.get()) {
+            cancelCompletion(modelHandle)
+        }
+    }
 
     override suspend fun release() {
         withContext(Dispatchers.IO) {
@@ -194,12 +492,58 @@ class GGUFModelRuntime @Inject constructor() : ModelRuntime {
             }
             isModelLoaded = false
             modelPath = null
+            conversationId = null
         }
     }
 
     override fun getPerformanceMetrics(): PerformanceMetrics {
-        return PerformanceMetrics(0f, 0L, 0L, "GGUF")
+        val metrics = getDetailedMetrics()
+            ?: return PerformanceMetrics(0f, 0L, 0L, "GGUF")
+        val averageLatency = if (metrics.decodeTokens > 0) (metrics.decodeMs / metrics.decodeTokens).toLong() else 0L
+        return PerformanceMetrics(
+            tokensPerSecond = getResponseGenerationSpeed(modelHandle),
+            averageLatency = averageLatency,
+            memoryUsageMB = metrics.peakRssKb / 1024,
+            hardwareAccelerator = "GGUF"
+        )
     }
 
     override fun isReady(): Boolean = isModelLoaded
 }
+
+// KV cache element type; ordinal matches the native KvCacheType enum
+enum class KvCacheType {
+    F16,
+    Q8_0,
+    Q4_0,
+    AUTO    // Chosen by the native memory planner at load time
+}
+
+// Called from native code after each prefill chunk; return false to cancel
+fun interface PrefillProgressListener {
+    fun onProgress(processed: Int, total: Int): Boolean
+}
+
+// Called from the native generation thread
+interface GenerationListener {
+    // A batch of generated text; return false to stop generation
+    fun onText(text: String): Boolean
+
+    // Generation finished (EOG, token limit, cancel) or failed with error
+    fun onComplete(tokenCount: Int, error: String?)
+}
+
+// Called from native code for each candidate of a parallel sampling run
+interface CandidateListener {
+    // Next piece of one candidate; return false to stop that candidate
+    fun onText(candidateId: Int, text: String): Boolean
+
+    // Candidate finished (EOG, token limit or stopped)
+    fun onComplete(candidateId: Int, tokenCount: Int)
+}
+
+// One streamed piece of a candidate response
+data class CandidateChunk(
+    val candidateId: Int,
+    val text: String
+)
@@ -0,0 +1,25 @@
+package com.rapo.haloai.data.model
+
+// Per-phase timings from the native engine; load/page-in/warm-up describe the model, the rest the last response
+data class InferenceMetrics(
+    val loadMs: Float,
+    val pageInMs: Float,
+    val warmupMs: Float,
+    val prefillTokens: Int,
+    val prefillMs: Float,
+    val timeToFirstTokenMs: Float,
+    val decodeTokens: Int,
+    val decodeMs: Float,
+    val decodeP50Ms: Float,
+    val decodeP95Ms: Float,
+    val decodeP99Ms: Float,
+    val sampleMs: Float,
+    val detokenizeMs: Float,
+    val peakRssKb: Long
+) {
+    val prefillTokensPerSecond: Float
+        get() = if (prefillMs > 0f) prefillTokens * 1000f / prefillMs else 0f
+
+    val decodeTokensPerSecond: Float
+        get() = if (decodeMs > 0f) decodeTokens * 1000f / decodeMs else 0f
+}
@@ -0,0 +1,19 @@
+package com.rapo.haloai.data.model
+
+// Estimated footprint of a load configuration from the native memory planner
+data class MemoryPlan(
+    val fits: Boolean,
+    val contextLength: Int,
+    val kvCacheTypeOrdinal: Int,
+    val flashAttention: Boolean,        // Quantizes V too; as passed to planMemory
+    val threads: Int,
+    val weightsBytes: Long,
+    val kvBytes: Long,
+    val computeBytes: Long,
+    val overheadBytes: Long,
+    val totalBytes: Long,
+    val budgetBytes: Long
+) {
+    val kvCacheType: KvCacheType
+        get() = KvCacheType.entries[kvCacheTypeOrdinal]
+}
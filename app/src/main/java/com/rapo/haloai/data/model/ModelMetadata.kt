@@ -1,8 +1,18 @@
 package com.rapo.haloai.data.model
 
+// Read from the GGUF header only; the constructor signature is used by the native bridge
 data class ModelMetadata(
     val contextSize: Int,
     val chatTemplate: String,
     val architecture: String,
-    val valid: Boolean
+    val valid: Boolean,
+    val name: String = "",
+    val quantization: String = "",      // e.g. "Q4_K_M"
+    val parameterCount: Long = 0,
+    val layerCount: Int = 0,
+    val vocabSize: Int = 0,
+    val embeddingLength: Int = 0,
+    val headCount: Int = 0,
+    val headCountKv: Int = 0,
+    val tensorBytes: Long = 0           // Weight data size
 )
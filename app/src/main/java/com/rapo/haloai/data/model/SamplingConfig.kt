@@ -0,0 +1,15 @@
+package com.rapo.haloai.data.model
+
+// Per-request sampler settings; field names are read by the native bridge
+data class SamplingConfig(
+    val temperature: Float = 0.8f,      // <= 0 selects greedy decoding
+    val topK: Int = 40,                 // <= 0 disables
+    val topP: Float = 0.95f,            // >= 1 disables
+    val minP: Float = 0f,               // <= 0 disables
+    val repeatPenalty: Float = 1f,      // 1 disables
+    val frequencyPenalty: Float = 0f,
+    val presencePenalty: Float = 0f,
+    val seed: Int = -1,                 // < 0 picks a random seed
+    val grammar: String? = null,        // GBNF the response must match
+    val jsonSchema: String? = null      // JSON schema the response must match (overrides grammar)
+)
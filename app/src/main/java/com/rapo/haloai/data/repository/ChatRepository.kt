@@ -61,4 +61,8 @@ class ChatRepository @Inject constructor(
     suspend fun updateSessionTimestamp(sessionId: String) {
         chatDao.updateSessionTimestamp(sessionId, System.currentTimeMillis())
     }
+    
+    suspend fun updateSessionTitle(sessionId: String, title: String) {
+        chatDao.updateSessionTitle(sessionId, title)
+    }
 }
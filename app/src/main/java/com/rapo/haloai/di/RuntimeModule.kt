@@ -16,8 +16,10 @@ object RuntimeModule {
     
     @Provides
     @Singleton
-    fun provideGGUFRuntime(): GGUFModelRuntime {
-        return GGUFModelRuntime()
+    fun provideGGUFRuntime(
+        @ApplicationContext context: Context
+    ): GGUFModelRuntime {
+        return GGUFModelRuntime(context)
     }
     
     @Provides
@@ -31,6 +31,7 @@ import androidx.compose.ui.text.style.TextOverflow
 import android.content.Intent
 import androidx.hilt.navigation.compose.hiltViewModel
 import androidx.navigation.NavController
+import com.rapo.haloai.data.model.KvCacheType
 import com.rapo.haloai.presentation.viewmodel.ChatViewModel
 import com.halilibo.richtext.ui.material3.Material3RichText
 import com.halilibo.richtext.markdown.Markdown
@@ -56,6 +57,7 @@ fun ChatScreen(
     val currentSessionId by viewModel.currentSessionId.collectAsState()
     val generationSpeed by viewModel.generationSpeed.collectAsState()
     val contextUsed by viewModel.contextUsed.collectAsState()
+    val prefillProgress by viewModel.prefillProgress.collectAsState()
     val listState = rememberLazyListState()
     val haptic = LocalHapticFeedback.current
     val coroutineScope = rememberCoroutineScope()
@@ -263,7 +265,7 @@ fun ChatScreen(
                             }
                         } else if (isGenerating) {
                             item {
-                                ThinkingIndicator()
+                                ThinkingIndicator(prefillProgress)
                             }
                         }
                     }
@@ -768,7 +770,7 @@ fun StreamingMessageItem(
 }
 
 @Composable
-fun ThinkingIndicator() {
+fun ThinkingIndicator(prefillProgress: Float = 0f) {
     Row(
         modifier = Modifier
             .clip(RoundedCornerShape(16.dp))
@@ -778,7 +780,11 @@ fun ThinkingIndicator() {
         horizontalArrangement = Arrangement.spacedBy(4.dp)
     ) {
         Text(
-            text = "Halo Chat is thinking",
+            text = if (prefillProgress > 0f && prefillProgress < 1f) {
+                "Reading prompt ${(prefillProgress * 100).toInt()}%"
+            } else {
+                "Halo Chat is thinking"
+            },
             style = MaterialTheme.typography.bodyMedium,
             color = MaterialTheme.colorScheme.onSurfaceVariant
         )
@@ -910,6 +916,61 @@ fun ChatSettingsDialog(
                     valueRange = 0.1f..2.0f
                 )
                 
+                // Top-K
+                Text(
+                    "Top-K: ${if (settings.topK > 0) settings.topK else "Off"}",
+                    style = MaterialTheme.typography.bodyMedium
+                )
+                Text(
+                    "Sample only from the K most likely tokens (0 = off)",
+                    style = MaterialTheme.typography.bodySmall,
+                    color = MaterialTheme.colorScheme.onSurfaceVariant
+                )
+                Slider(
+                    value = settings.topK.toFloat(),
+                    onValueChange = { viewModel.updateTopK(it.toInt()) },
+                    valueRange = 0f..100f
+                )
+                
+                // Top-P
+                Text("Top-P: ${"%.2f".format(settings.topP)}", style = MaterialTheme.typography.bodyMedium)
+                Text(
+                    "Smallest set of tokens covering this probability (1 = off)",
+                    style = MaterialTheme.typography.bodySmall,
+                    color = MaterialTheme.colorScheme.onSurfaceVariant
+                )
+                Slider(
+                    value = settings.topP,
+                    onValueChange = { viewModel.updateTopP(it) },
+                    valueRange = 0.1f..1.0f
+                )
+                
+                // Min-P
+                Text("Min-P: ${"%.2f".format(settings.minP)}", style = MaterialTheme.typography.bodyMedium)
+                Text(
+                    "Drop tokens less likely than this fraction of the top one (0 = off)",
+                    style = MaterialTheme.typography.bodySmall,
+                    color = MaterialTheme.colorScheme.onSurfaceVariant
+                )
+                Slider(
+                    value = settings.minP,
+                    onValueChange = { viewModel.updateMinP(it) },
+                    valueRange = 0f..0.3f
+                )
+                
+                // Repeat Penalty
+                Text("Repeat Penalty: ${"%.2f".format(settings.repeatPenalty)}", style = MaterialTheme.typography.bodyMedium)
+                Text(
+                    "Discourage repeating recent tokens (1 = off)",
+                    style = MaterialTheme.typography.bodySmall,
+                    color = MaterialTheme.colorScheme.onSurfaceVariant
+                )
+                Slider(
+                    value = settings.repeatPenalty,
+                    onValueChange = { viewModel.updateRepeatPenalty(it) },
+                    valueRange = 1.0f..1.5f
+                )
+                
                 HorizontalDivider()
                 
                 // CPU Threads
@@ -951,6 +1012,46 @@ fun ChatSettingsDialog(
                     valueRange = 1024f..8192f,
                     steps = 7
                 )
+                
+                // KV Cache Type
+                Text("KV Cache Type", style = MaterialTheme.typography.bodyMedium)
+                Text(
+                    "Quantized caches fit longer contexts in less memory (Requires model reload)",
+                    style = MaterialTheme.typography.bodySmall,
+                    color = MaterialTheme.colorScheme.onSurfaceVariant
+                )
+                Row(horizontalArrangement = Arrangement.spacedBy(8.dp)) {
+                    listOf(KvCacheType.F16, KvCacheType.Q8_0, KvCacheType.Q4_0).forEach { type ->
+                        FilterChip(
+                            selected = !settings.autoMemory && settings.kvCacheType == type,
+                            onClick = {
+                                if (settings.autoMemory || type != settings.kvCacheType) {
+                                    viewModel.updateKvCacheType(type)
+                                }
+                            },
+                            label = { Text(type.name) }
+                        )
+                    }
+                }
+                
+                // Flash Attention
+                Row(
+                    modifier = Modifier.fillMaxWidth(),
+                    verticalAlignment = Alignment.CenterVertically
+                ) {
+                    Column(modifier = Modifier.weight(1f)) {
+                        Text("Flash Attention", style = MaterialTheme.typography.bodyMedium)
+                        Text(
+                            "Needed for a quantized V cache (Requires model reload)",
+                            style = MaterialTheme.typography.bodySmall,
+                            color = MaterialTheme.colorScheme.onSurfaceVariant
+                        )
+                    }
+                    Switch(
+                        checked = settings.flashAttention,
+                        onCheckedChange = { viewModel.updateFlashAttention(it) }
+                    )
+                }
             }
         },
         confirmButton = {
@@ -7,8 +7,10 @@ import com.rapo.haloai.data.database.entities.ChatEntity
 import com.rapo.haloai.data.database.entities.ChatSessionEntity
 import com.rapo.haloai.data.database.entities.ModelEntity
 import java.util.UUID
+import com.rapo.haloai.data.model.KvCacheType
 import com.rapo.haloai.data.model.ModelManager
 import com.rapo.haloai.data.model.ModelRuntime
+import com.rapo.haloai.data.model.SamplingConfig
 import com.rapo.haloai.data.repository.ChatRepository
 import com.rapo.haloai.data.repository.ModelRepository
 import dagger.hilt.android.lifecycle.HiltViewModel
@@ -58,6 +60,9 @@ class ChatViewModel @Inject constructor(
     private val _contextUsed = MutableStateFlow(0)
     val contextUsed = _contextUsed.asStateFlow()
     
+    private val _prefillProgress = MutableStateFlow(0f)
+    val prefillProgress = _prefillProgress.asStateFlow()
+    
     // Session management
     private val _currentSessionId = MutableStateFlow(UUID.randomUUID().toString())
     val currentSessionId = _currentSessionId.asStateFlow()
@@ -152,7 +157,8 @@ class ChatViewModel @Inject constructor(
             chatRepository.insertMessage(userMessage)
             
             // Auto-generate title for first message
-            if (_messages.value.isEmpty()) {
+            val newChat = _messages.value.isEmpty()
+            if (newChat) {
                 val title = generateSessionTitle(message)
                 chatRepository.insertSession(
                     ChatSessionEntity(
@@ -174,12 +180,13 @@ class ChatViewModel @Inject constructor(
             
             // Start new generation with job tracking
             generationJob = viewModelScope.launch {
-                generateAIResponse(message, model)
+                generateAIResponse(message, model, newChat)
             }
         }
     }
     
-    private suspend fun generateAIResponse(prompt: String, model: ModelEntity) {
+    private suspend fun generateAIResponse(prompt: String, model: ModelEntity, newChat: Boolean = false) {
+        var progressJob: kotlinx.coroutines.Job? = null
         try {
             Log.d(TAG, "Starting generation with model: ${model.name}")
             Log.d(TAG, "Model path: ${model.path}")
@@ -191,9 +198,17 @@ class ChatViewModel @Inject constructor(
                 
                 // Apply settings to runtime if it's GGUF
                 if (runtime is com.rapo.haloai.data.model.GGUFModelRuntime) {
-                    runtime.threads = _generationSettings.value.threads
-                    runtime.contextLength = _generationSettings.value.contextLength
-                    Log.d(TAG, "Applied settings: threads=${runtime.threads}, context=${runtime.contextLength}")
+                    val settings = _generationSettings.value
+                    val auto = com.rapo.haloai.data.model.GGUFModelRuntime.AUTO
+                    // With autoMemory the native planner sizes the load to free memory
+                    runtime.threads = if (settings.autoMemory) auto else settings.threads
+                    runtime.contextLength = if (settings.autoMemory) auto else settings.contextLength
+                    runtime.temperature = settings.temperature
+                    runtime.kvCacheType = if (settings.autoMemory) KvCacheType.AUTO else settings.kvCacheType
+                    runtime.flashAttention = settings.flashAttention
+                    // Automatic threads keep adjusting to throttling after load
+                    runtime.threadAutoTune = settings.autoMemory
+                    Log.d(TAG, "Applied settings: threads=${runtime.threads}, context=${runtime.contextLength}, kv=${runtime.kvCacheType}, flashAttention=${runtime.flashAttention}")
                 }
                 
                 val loadResult = modelManager.loadModel(model)
@@ -211,6 +226,13 @@ class ChatViewModel @Inject constructor(
                 throw Exception("Model runtime not available")
             }
             
+            // Mirror prefill progress from the GGUF runtime while this response runs
+            progressJob = (currentRuntime as? com.rapo.haloai.data.model.GGUFModelRuntime)?.let { gguf ->
+                viewModelScope.launch {
+                    gguf.prefillProgress.collect { _prefillProgress.value = it }
+                }
+            }
+            
             // Generate response with streaming and track performance
             Log.d(TAG, "Starting generation...")
             val startTime = System.currentTimeMillis()
@@ -227,30 +249,46 @@ class ChatViewModel @Inject constructor(
             if (currentRuntime is com.rapo.haloai.data.model.GGUFModelRuntime) {
                 val ggufRuntime = currentRuntime as com.rapo.haloai.data.model.GGUFModelRuntime
 
-                // Clear existing conversation and rebuild with complete history
-                ggufRuntime.clearConversation()
+                // The native history grows by one exchange per response; rebuild it
+                // only when it belongs to another chat (or a response was discarded)
+                val sessionId = _currentSessionId.value
+                if (ggufRuntime.conversationId != sessionId) {
+                    ggufRuntime.clearConversation()
 
-                // Add conversation history to model (last 10 messages for context)
-                for (msg in conversationMessages) {
-                    val role = when(msg.role) {
-                        "user" -> "user"
-                        "assistant" -> "assistant"
-                        else -> "system"
+                    // The current prompt is added by the runtime itself
+                    val history = conversationMessages.let {
+                        val last = it.lastOrNull()
+                        if (last != null && last.role == "user" && last.content == prompt) it.dropLast(1) else it
                     }
-                    // Extract clean message content without metadata footer
-                    val cleanContent = if (msg.role == "assistant") {
-                        msg.content.substringBefore("\n\n---\n").trim()
-                    } else {
-                        msg.content.trim()
+                    for (msg in history) {
+                        val role = when(msg.role) {
+                            "user" -> "user"
+                            "assistant" -> "assistant"
+                            else -> "system"
+                        }
+                        // Extract clean message content without metadata footer
+                        val cleanContent = if (msg.role == "assistant") {
+                            msg.content.substringBefore("\n\n---\n").trim()
+                        } else {
+                            msg.content.trim()
+                        }
+                        ggufRuntime.addConversationMessage(cleanContent, role)
                     }
-                    ggufRuntime.addConversationMessage(cleanContent, role)
+                    ggufRuntime.conversationId = sessionId
                 }
 
                 // Clear any system prompt from input since it's handled by chat template
                 val cleanPrompt = prompt.removePrefix("System: ").trim()
 
+                // Sampler settings apply per request without reloading the model
+                ggufRuntime.sampling = _generationSettings.value.toSamplingConfig()
+
+                if (newChat) {
+                    launchSessionTitle(ggufRuntime, sessionId, cleanPrompt)
+                }
+
                 // Start generation with just the current user message
-                Log.d(TAG, "GGUF generation: cleared conversation, rebuilt with ${conversationMessages.size} messages, prompt: \"$cleanPrompt\"")
+                Log.d(TAG, "GGUF generation: prompt: \"$cleanPrompt\"")
                 currentRuntime.generateResponse(cleanPrompt, maxTokens = maxTokens)
             } else {
                 // ONNX runtime - build simple text prompt with history
@@ -297,6 +335,11 @@ class ChatViewModel @Inject constructor(
                     }
                 }
             
+            // GGUF text arrives in batches; take the real token count from the runtime
+            if (currentRuntime is com.rapo.haloai.data.model.GGUFModelRuntime) {
+                tokenCount = currentRuntime.getLastResponseTokenCount()
+            }
+            
             Log.d(TAG, "Token generation finished. Total tokens: $tokenCount")
             Log.d(TAG, "Response length: ${assistantMessage.length} chars")
             
@@ -348,6 +391,11 @@ class ChatViewModel @Inject constructor(
             // Update session timestamp
             chatRepository.updateSessionTimestamp(_currentSessionId.value)
             
+            // Snapshot the KV cache so reopening this chat skips prefill
+            if (currentRuntime is com.rapo.haloai.data.model.GGUFModelRuntime) {
+                currentRuntime.saveSessionState(_currentSessionId.value)
+            }
+            
             // Update metrics
             _generationSpeed.value = tokensPerSecond
             if (currentRuntime is com.rapo.haloai.data.model.GGUFModelRuntime) {
@@ -360,10 +408,13 @@ class ChatViewModel @Inject constructor(
             
         } catch (e: kotlinx.coroutines.CancellationException) {
             Log.d(TAG, "Generation cancelled - cleaning up")
+            // The native history may hold a reply that is not saved here; rebuild it next time
+            (modelManager.getCurrentRuntime() as? com.rapo.haloai.data.model.GGUFModelRuntime)?.conversationId = null
             // Don't save cancelled responses
             throw e
         } catch (e: Exception) {
             Log.e(TAG, "Error in generateAIResponse", e)
+            (modelManager.getCurrentRuntime() as? com.rapo.haloai.data.model.GGUFModelRuntime)?.conversationId = null
             // Handle error - show error message
             val errorMessage = ChatEntity(
                 sessionId = _currentSessionId.value,
@@ -373,6 +424,8 @@ class ChatViewModel @Inject constructor(
             )
             chatRepository.insertMessage(errorMessage)
         } finally {
+            progressJob?.cancel()
+            _prefillProgress.value = 0f
             _isGenerating.value = false
             _streamedResponse.value = ""
             generationJob = null
@@ -394,6 +447,7 @@ class ChatViewModel @Inject constructor(
                     // Use model's optimal settings
                     pendingSettingsChange = {
                         _generationSettings.value = _generationSettings.value.copy(
+                            autoMemory = false,
                             contextLength = metadata.contextSize,
                             maxTokens = metadata.contextSize / 2 // Half for response
                         )
@@ -410,6 +464,9 @@ class ChatViewModel @Inject constructor(
     }
     
     fun stopGeneration() {
+        viewModelScope.launch {
+            modelManager.getCurrentRuntime()?.stopGeneration()
+        }
         generationJob?.cancel()
         _isGenerating.value = false
         _streamedResponse.value = ""
@@ -441,6 +498,11 @@ class ChatViewModel @Inject constructor(
             // Clear messages immediately when creating new chat
             _messages.value = emptyList()
             _currentSessionId.value = newSessionId
+            (modelManager.getCurrentRuntime() as? com.rapo.haloai.data.model.GGUFModelRuntime)?.let {
+                it.startNewConversation(_generationSettings.value.systemPrompt)
+                // The fresh native history already belongs to the new chat
+                it.conversationId = newSessionId
+            }
             Log.d(TAG, "Created new chat session: $newSessionId")
         }
     }
@@ -454,7 +516,14 @@ class ChatViewModel @Inject constructor(
             val runtime = modelManager.getCurrentRuntime()
             if (runtime is com.rapo.haloai.data.model.GGUFModelRuntime) {
                 runtime.clearConversation()
+                // Without a restored snapshot the next turn must replay the history
+                runtime.conversationId = null
                 Log.d(TAG, "Cleared conversation history when switching to session: $sessionId")
+                if (runtime.restoreSessionState(sessionId)) {
+                    // The snapshot carries the native history too; no need to replay it
+                    runtime.conversationId = sessionId
+                    Log.d(TAG, "Restored KV snapshot for session: $sessionId")
+                }
             }
         }
         Log.d(TAG, "Switched to session: $sessionId")
@@ -463,6 +532,8 @@ class ChatViewModel @Inject constructor(
     fun deleteSession(sessionId: String) {
         viewModelScope.launch {
             chatRepository.deleteSessionWithMessages(sessionId)
+            (modelManager.getCurrentRuntime() as? com.rapo.haloai.data.model.GGUFModelRuntime)
+                ?.deleteSessionState(sessionId)
             // If deleting current session, create new one
             if (_currentSessionId.value == sessionId) {
                 createNewChat()
@@ -497,9 +568,25 @@ class ChatViewModel @Inject constructor(
         _generationSettings.value = _generationSettings.value.copy(temperature = value)
     }
     
+    fun updateTopK(value: Int) {
+        _generationSettings.value = _generationSettings.value.copy(topK = value)
+    }
+    
+    fun updateTopP(value: Float) {
+        _generationSettings.value = _generationSettings.value.copy(topP = value)
+    }
+    
+    fun updateMinP(value: Float) {
+        _generationSettings.value = _generationSettings.value.copy(minP = value)
+    }
+    
+    fun updateRepeatPenalty(value: Float) {
+        _generationSettings.value = _generationSettings.value.copy(repeatPenalty = value)
+    }
+    
     fun updateThreads(value: Int) {
         pendingSettingsChange = {
-            _generationSettings.value = _generationSettings.value.copy(threads = value)
+            _generationSettings.value = _generationSettings.value.copy(threads = value, autoMemory = false)
             viewModelScope.launch {
                 modelManager.unloadModel()
             }
@@ -509,7 +596,27 @@ class ChatViewModel @Inject constructor(
     
     fun updateContextLength(value: Int) {
         pendingSettingsChange = {
-            _generationSettings.value = _generationSettings.value.copy(contextLength = value)
+            _generationSettings.value = _generationSettings.value.copy(contextLength = value, autoMemory = false)
+            viewModelScope.launch {
+                modelManager.unloadModel()
+            }
+        }
+        _showReloadModelDialog.value = true
+    }
+    
+    fun updateKvCacheType(value: KvCacheType) {
+        pendingSettingsChange = {
+            _generationSettings.value = _generationSettings.value.copy(kvCacheType = value, autoMemory = false)
+            viewModelScope.launch {
+                modelManager.unloadModel()
+            }
+        }
+        _showReloadModelDialog.value = true
+    }
+    
+    fun updateFlashAttention(enabled: Boolean) {
+        pendingSettingsChange = {
+            _generationSettings.value = _generationSettings.value.copy(flashAttention = enabled)
             viewModelScope.launch {
                 modelManager.unloadModel()
             }
@@ -545,6 +652,30 @@ class ChatViewModel @Inject constructor(
         Log.d(TAG, "Model reload cancelled")
     }
     
+    // Replaces a new chat's placeholder title with one the model writes. It runs as a
+    // batched side session, so it decodes alongside the response instead of after it.
+    private fun launchSessionTitle(runtime: com.rapo.haloai.data.model.GGUFModelRuntime, sessionId: String, firstMessage: String) {
+        viewModelScope.launch {
+            try {
+                val prompt = "Write a title of at most six words for a chat that starts with:\n" +
+                    "\"${firstMessage.take(500)}\"\nTitle:"
+                val raw = StringBuilder()
+                runtime.runBatchedSession(prompt, maxTokens = 16).collect { raw.append(it) }
+                val title = raw.lineSequence()
+                    .map { it.trim().trim('"') }
+                    .firstOrNull { it.isNotEmpty() }
+                    ?.take(40)
+                if (title != null) {
+                    chatRepository.updateSessionTitle(sessionId, title)
+                }
+            } catch (e: kotlinx.coroutines.CancellationException) {
+                throw e
+            } catch (e: Exception) {
+                Log.w(TAG, "Session title generation failed", e)
+            }
+        }
+    }
+    
     private fun generateSessionTitle(firstMessage: String): String {
         // Generate a short title from the first message (max 30 chars)
         return firstMessage.take(30).trim().let { 
@@ -563,7 +694,22 @@ class ChatViewModel @Inject constructor(
 data class GenerationSettings(
     val maxTokens: Int = 2048, // Max tokens per response
     val temperature: Float = 0.7f,
+    val topK: Int = 40,
+    val topP: Float = 0.95f,
+    val minP: Float = 0f,          // 0 = off
+    val repeatPenalty: Float = 1f, // 1 = off
     val threads: Int = 4,
     val contextLength: Int = 4096, // Increased from 1535 to handle longer responses
-    val systemPrompt: String = ""
-)
+    val systemPrompt: String = "",
+    val kvCacheType: KvCacheType = KvCacheType.F16,
+    val flashAttention: Boolean = false, // Needed for a quantized V cache
+    val autoMemory: Boolean = true // Threads, context and KV type from the memory planner; manual edits turn it off
+) {
+    fun toSamplingConfig() = SamplingConfig(
+        temperature = temperature,
+        topK = topK,
+        topP = topP,
+        minP = minP,
+        repeatPenalty = repeatPenalty
+    )
+}